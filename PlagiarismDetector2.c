@@ -4,6 +4,17 @@
 #include <ctype.h>
 #include <math.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <pthread.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_SIMD 1
+#endif
 
 /**
  * TEXTGUARD ADVANCED ENGINE (C VERSION - RANKING ENABLED)
@@ -11,201 +22,4667 @@
  */
 
 #define MAX_TEXT 100000
-#define MAX_WORDS 20000
-#define MAX_WORD_LEN 64
-#define BLOOM_SIZE 1000000
+#define MAX_PHRASE_LEN 320 // display buffer for a matched phrase
+#define BLOOM_FPR 0.01     // target false-positive rate of the Bloom gatekeeper
 #define MOD1 1000000007LL
 #define MOD2 1000000009LL
 #define BASE 131LL
-#define TABLE_SIZE 100003
-#define TOP_K 5
+#define TABLE_SIZE 100003 // fixed size of the legacy linear-probing set (benchmark baseline)
+#define TOP_K 5 // default number of ranked phrases
+#define MAX_RESOLUTIONS 8 // n-gram sizes handled by one multi-resolution pass
+#define MAX_CORPUS_DOCS 100000 // reference documents accepted by the corpus scan prompt
+#define INDEX_MAGIC "TGINDEX"  // first 8 bytes of an index file (with the NUL)
+#define INDEX_VERSION 1
+#define MINHASH_SIZE 128       // default MinHash signature length
+#define SIMHASH_MAX_DISTANCE 3 // default Hamming radius of SimHash lookups
+#define SIMHASH_MAX_TABLES 8   // permuted tables, one per block: radius up to 7
+#define MAX_SHARDS 64          // upper bound on query shards (one worker thread each)
+#define COMPACT_FANOUT 4       // merge a newer segment run once an older neighbour is under 4x its size
+#define COMPACT_DEAD_RATIO 0.5 // rewrite a segment once this fraction of its documents is removed
+
+// Build-time switches (override with -D on the compiler command line; see
+// README.md). Build with: cc -O2 -pthread PlagiarismDetector2.c -lm
+#ifndef VERIFY_ROLLING
+#define VERIFY_ROLLING 0 // 1 = cross-check rolling hashes against get_double_hash
+#endif
+#ifndef HASH_M61
+#define HASH_M61 0       // 1 = one 64-bit hash mod 2^61-1 instead of the MOD1/MOD2 pair
+#endif
+#ifndef USE_FUSE_FILTER
+#define USE_FUSE_FILTER 0 // 1 = binary fuse filter instead of the Bloom filter in front of set_contains
+#endif
+#ifndef USE_SPACE_SAVING
+#define USE_SPACE_SAVING 0 // 1 = rank phrases with a bounded Space-Saving sketch instead of the exact map
+#endif
+#ifndef SPACE_SAVING_PER_K
+#define SPACE_SAVING_PER_K 64 // Space-Saving counters kept per ranked phrase
+#endif
+#ifndef USE_MERGE_JOIN
+#define USE_MERGE_JOIN 0 // 1 = sorted merge-join instead of hashing + gatekeeper for the suspect scan
+#endif
+#ifndef TEXTGUARD_BENCH
+#define TEXTGUARD_BENCH 0 // 1 = run the microbenchmarks instead of the interactive scan
+#endif
+#ifndef TEXTGUARD_SELFTEST
+#define TEXTGUARD_SELFTEST 0 // 1 = run the self-tests instead of the interactive scan
+#endif
+
+#define MOD61 ((1ULL << 61) - 1)
+
+#if TEXTGUARD_SELFTEST
+// Heap calls made by this file, so a self-test can check that a warm arena
+// serves a whole comparison without them.
+static long selftest_heap_calls = 0;
+static void* selftest_malloc(size_t n) {
+    __atomic_fetch_add(&selftest_heap_calls, 1, __ATOMIC_RELAXED);
+    return malloc(n);
+}
+static void* selftest_calloc(size_t n, size_t size) {
+    __atomic_fetch_add(&selftest_heap_calls, 1, __ATOMIC_RELAXED);
+    return calloc(n, size);
+}
+static void* selftest_realloc(void *p, size_t n) {
+    __atomic_fetch_add(&selftest_heap_calls, 1, __ATOMIC_RELAXED);
+    return realloc(p, n);
+}
+static void* selftest_aligned_alloc(size_t align, size_t n) {
+    __atomic_fetch_add(&selftest_heap_calls, 1, __ATOMIC_RELAXED);
+    return aligned_alloc(align, n);
+}
+#define malloc(n) selftest_malloc(n)
+#define calloc(n, size) selftest_calloc(n, size)
+#define realloc(p, n) selftest_realloc(p, n)
+#define aligned_alloc(align, n) selftest_aligned_alloc(align, n)
+#endif
 
 // --- DATA STRUCTURES ---
 
-//double hash of an n-gram.
-typedef struct {
-    long long h1;
-    long long h2;
-} Fingerprint;
+// Bump allocator that owns all per-comparison state. Blocks are chained and
+// kept across arena_reset, so a steady stream of comparisons stops touching
+// the heap once the largest one has been seen.
+typedef struct ArenaBlock {
+    struct ArenaBlock *next;
+    size_t size;        // usable bytes after the header
+    size_t used;
+} ArenaBlock;
+
+typedef struct {
+    ArenaBlock *head;
+    ArenaBlock *cur;
+    size_t blockSize;   // minimum size of a new block
+} Arena;
+
+#if HASH_M61
+//single 61-bit hash of an n-gram.
+typedef struct {
+    uint64_t h1;
+} Fingerprint;
+#define HASH_FAMILY_NAME "Mersenne-61 (1 x 64-bit)"
+#else
+//double hash of an n-gram.
+typedef struct {
+    long long h1;
+    long long h2;
+} Fingerprint;
+#define HASH_FAMILY_NAME "MOD1/MOD2 (2 x 64-bit)"
+#endif
+
+
+// Split-block Bloom filter: a key picks one 64-byte block (a cache line) and
+// sets all k of its bits inside it, so a check costs a single cache miss.
+typedef struct {
+    uint64_t *blocks;   // numBlocks * 8 words, 64-byte aligned
+    uint32_t numBlocks;
+    int k;
+    Arena *arena;       // owner, or NULL if heap-allocated
+} BloomFilter;
+
+// Immutable binary fuse filter (3-wise, 8-bit fingerprints): ~9 bits per key,
+// ~0.4% false positives, three memory accesses per query.
+typedef struct {
+    uint64_t seed;
+    uint32_t segmentLength;
+    uint32_t segmentLengthMask;
+    uint32_t segmentCount;
+    uint32_t segmentCountLength;
+    uint32_t arrayLength;
+    uint32_t size;              // keys the filter was built from
+    uint8_t *fingerprints;
+    Arena *arena;
+} FuseFilter;
+
+// SwissTable-style open addressing keyed by fingerprint: one control byte per
+// slot (CTRL_EMPTY, CTRL_DELETED or a 7-bit tag of the key's hash), probed 16
+// slots at a time, power-of-two capacity, rehashed before used + deleted slots
+// pass 7/8. An optional fixed-size value is stored per slot.
+typedef struct {
+    unsigned char *ctrl;
+    Fingerprint *keys;
+    unsigned char *vals;    // capacity * valSize bytes, NULL for a plain set
+    size_t valSize;
+    size_t capacity;
+    size_t size;
+    size_t deleted;         // tombstones left by table_erase
+    Arena *arena;
+} FpTable;
+
+typedef FpTable FingerprintSet;
+
+// Structure to track how many times a matching phrase appeared. The phrase
+// itself is rebuilt from firstPos only if the entry makes the final top-K.
+typedef struct {
+    int frequency;
+    int firstPos;   // token position of the first occurrence in the suspect
+    int phraseLen;  // characters in the phrase, for tie-breaking
+    int heapSlot;   // position in the ranking heap, -1 when not ranked
+} FreqEntry;
+
+// How entries with equal frequency are ordered.
+typedef enum {
+    TIE_FIRST_POSITION,     // earlier first occurrence ranks higher
+    TIE_PHRASE_LENGTH       // longer phrase ranks higher, then earlier
+} TieBreak;
+
+// Streaming top-K: a min-heap of entry indices (worst ranked at the root)
+// maintained as counts change, so ranking never sweeps the whole map.
+typedef struct {
+    int k;
+    int *heap;
+    int size;
+    TieBreak tie;
+} TopK;
+
+// A word by position rather than by copy.
+typedef struct {
+    int offset;
+    int length;
+} TokenSpan;
+
+// Batch-wide word dictionary. Each distinct word gets a dense 32-bit ID; its
+// text, length and Rabin-Karp hash are stored once and indexed by that ID.
+typedef struct {
+    char *chars;            // interned words back to back
+    size_t charsLen;
+    size_t charsCap;
+    TokenSpan *words;       // per ID: location in chars
+    Fingerprint *hash;      // per ID: hash of the word's characters
+    uint32_t *keyHash;      // per ID: string hash used by the slot table
+    uint32_t count;
+    uint32_t cap;
+    uint32_t *slots;        // open addressing over IDs, ID + 1 (0 = empty)
+    uint32_t slotMask;
+    int maxLen;             // longest word interned so far
+} Lexicon;
+
+// Tokens of one document as interned word IDs (4 bytes per word).
+typedef struct {
+    const Lexicon *lex;
+    uint32_t *ids;
+    int count;
+    Arena *arena;
+} TokenList;
+
+// A fingerprint picked by winnowing, with the token position of its shingle.
+typedef struct {
+    Fingerprint fp;
+    int pos;
+} WinnowedFingerprint;
+
+// Streaming winnower: a monotonic deque (ring buffer of w slots) whose front
+// is always the minimum of the current window.
+typedef struct {
+    int w;
+    WinnowedFingerprint *ring;
+    int head;
+    int size;
+    int seen;       // hashes pushed so far
+    int lastPos;    // position of the last emitted fingerprint
+    Arena *arena;   // owner of ring, or NULL if heap-allocated
+} Winnower;
+
+// Fingerprints of a document at one n-gram size (multi-resolution mode).
+typedef struct {
+    int n;
+    Fingerprint *hashes;        // every shingle hash, or NULL
+    int numHashes;
+    WinnowedFingerprint *win;   // winnowed fingerprints, or NULL
+    int numWin;
+} Resolution;
+
+//ranking plagiarism intensity: fingerprint -> index into a dense entry array
+typedef struct {
+    FpTable *index;     // values are uint32_t entry indices
+    FreqEntry *entries;
+    int count;
+    int capacity;
+    TopK rank;
+    Arena *arena;
+} FrequencyMap;
+
+// Space-Saving heavy-hitter sketch (Metwally et al.): m counters, whatever
+// the number of distinct matches. A counter's frequency overestimates its
+// phrase by at most error[i] <= total / m, so any phrase seen more than
+// total / m times is guaranteed to be monitored.
+typedef struct {
+    FpTable *index;     // fingerprint -> counter index (uint32_t)
+    FreqEntry *entries; // m counters
+    Fingerprint *fps;   // fingerprint monitored by each counter
+    int *error;         // overestimate inherited on eviction
+    int m;
+    int count;
+    int k;
+    TopK order;         // min-heap over all m counters; the root is evicted
+    long long total;    // updates seen
+    Arena *arena;
+} SpaceSaving;
+
+// One occurrence of a winnowed fingerprint in the reference corpus.
+typedef struct {
+    uint32_t doc;
+    uint32_t pos;   // token position in that document
+} Posting;
+
+// Reference corpus as fingerprint -> posting list. Postings are appended as
+// documents are added and grouped by term (CSR layout) on the first query
+// after a change; within a term they stay in document order.
+typedef struct {
+    FpTable *terms;         // fingerprint -> uint32_t term id
+    uint32_t numTerms;
+    Posting *postings;
+    uint32_t *postingTerm;  // term of each posting, kept alongside for regrouping
+    size_t numPostings;
+    size_t postingCap;
+    size_t grouped;         // postings covered by termStart
+    uint32_t *termStart;    // numTerms + 1 offsets into postings
+    char **names;
+    int *docFingerprints;   // distinct winnowed fingerprints per document
+    int numDocs;
+    int docCap;
+    BloomFilter *filter;    // optional gate in front of terms, or NULL
+    // Set when opened from a file: everything above points into the
+    // read-only mapping and the index cannot take new documents.
+    void *map;
+    size_t mapSize;
+    const uint32_t *nameOffsets;    // numDocs + 1 offsets into nameChars
+    const char *nameChars;
+} InvertedIndex;
+
+// Index file header. The file is the in-memory layout of a finalized index,
+// each section 64-byte aligned, so open_index only maps it and sets pointers.
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t endianTag;         // 0x01020304 as written by the producer
+    uint32_t hashM61;           // hash family the fingerprints come from
+    uint32_t fingerprintSize;   // sizeof(Fingerprint)
+    uint32_t n, w;              // shingle and window size used to build it
+    uint32_t numDocs, numTerms;
+    uint64_t numPostings;
+    uint64_t tableCapacity;     // slots in the fingerprint -> term table
+    uint32_t bloomK, bloomBlocks;   // 0 blocks = no filter
+    uint64_t ctrlOff, keysOff, valsOff;
+    uint64_t termStartOff, postingsOff;
+    uint64_t docFingerprintsOff, nameOffsetsOff, nameCharsOff;
+    uint64_t bloomOff;
+    uint64_t fileSize;
+} IndexHeader;
+
+// A reference document returned by index_query.
+typedef struct {
+    int doc;
+    const char *name;       // owned by the index (or snapshot) that was queried
+    int matches;            // suspect shingles found in the document
+    double score;           // matches / distinct document fingerprints, in %
+    int firstSuspectPos;    // earliest matching suspect shingle
+    int firstRefPos;        // a position of that fingerprint in the document
+} DocHit;
+
+// Removed documents of one segment (bit d = local document d). Shared by the
+// snapshots that see the same removals; a removal copies it.
+typedef struct {
+    int refs;
+    int count;
+    uint8_t bits[];
+} Tombstones;
+
+// An immutable, finalized index covering some documents of a Corpus.
+typedef struct {
+    InvertedIndex *idx;
+    uint32_t *globalIds;    // corpus-wide id per local document, ascending
+    int refs;
+} Segment;
+
+// The corpus as one query sees it, start to finish. Never modified once
+// published: commits, removals and compactions publish a new snapshot.
+typedef struct {
+    Segment **segs;         // oldest first
+    Tombstones **dead;      // per segment, NULL if nothing removed
+    int numSegs;
+    int refs;
+} CorpusSnapshot;
+
+// LSM-style reference corpus: added documents collect in an unpublished
+// memtable, a commit seals them into a new segment, removals are tombstones,
+// and compaction merges segments and drops removed documents.
+typedef struct {
+    pthread_mutex_t lock;       // guards current and all refcounts; held only briefly
+    pthread_mutex_t staging;    // guards pending, pendingBase and nextId
+    pthread_mutex_t committing; // one commit at a time, so segments stay in id order
+    pthread_mutex_t compacting; // one compaction at a time
+    pthread_cond_t wake;
+    CorpusSnapshot *current;
+    InvertedIndex *pending;     // added since the last commit, not yet visible
+    uint32_t pendingBase;       // global id of the first pending document
+    uint32_t nextId;
+    pthread_t compactor;
+    bool background;
+    bool stop;
+    bool dirty;                 // work for the background compactor
+    int compactions;
+} Corpus;
+
+// One nonzero of the all-pairs similarity matrix, a < b.
+typedef struct {
+    uint32_t a, b;
+    uint32_t shared;        // distinct winnowed fingerprints in common
+    float jaccard;          // shared / |A u B|
+} PairSimilarity;
+
+// Sparse (coordinate) all-pairs matrix, sorted by a then b.
+typedef struct {
+    PairSimilarity *pairs;
+    size_t count;
+    int numDocs;
+} SimilarityMatrix;
+
+// K independent hash functions (mix64 of the shingle key plus a seed) whose
+// minima over a document's shingle set form its MinHash signature, or, with
+// onePermutation, a single hash split into K bins.
+typedef struct {
+    int numHashes;
+    bool onePermutation;
+    uint64_t *seeds;
+} MinHasher;
+
+// Signatures reduced to their low `bits` bits per slot, stored as bit planes:
+// plane p of a signature holds bit p of every slot, `words` words per plane.
+typedef struct {
+    int numHashes, bits, words;
+    size_t count, cap;
+    uint64_t *data;         // count * bits * words
+} BbitSignatures;
+
+// A document pair proposed by LSH, a < b.
+typedef struct {
+    uint32_t a, b;
+    float estimate;         // fraction of equal signature slots (~ Jaccard)
+} CandidatePair;
+
+typedef struct {
+    uint32_t id;
+    int distance;
+} SimHashMatch;
+
+// 64-bit SimHashes split into maxDistance + 1 blocks. Two hashes within the
+// radius agree exactly on at least one block, so table t holds every hash
+// rotated to put block t on top, sorted, and a query only scans the run
+// sharing its own top block in each table.
+typedef struct {
+    int maxDistance, numTables;
+    int blockStart[SIMHASH_MAX_TABLES], blockBits[SIMHASH_MAX_TABLES];
+    size_t count, cap, built;
+    uint64_t *hashes;       // insertion order
+    uint32_t *ids;
+    uint64_t *keys[SIMHASH_MAX_TABLES];     // rotated, sorted by simhash_index_build
+    uint32_t *vals[SIMHASH_MAX_TABLES];
+} SimHashIndex;
+
+struct ShardedIndex;
+
+typedef struct {
+    struct ShardedIndex *si;
+    int shard;
+    const Fingerprint *hashes;  // this shard's part of the query
+    const int *pos;             // their suspect positions, ascending
+    int count;
+    int *slot;              // doc -> hit index, -1 if untouched (kept all -1 between queries)
+    DocHit *hits;           // this shard's candidates, sorted by doc
+    int numHits;
+} ShardWorker;
+
+// Parallel queries over one finalized index: the suspect's shingles are split
+// by fingerprint hash prefix into a power-of-two number of shards, each
+// probed by its own long-lived worker thread. With one shard there are no
+// workers and queries go straight to index_query.
+typedef struct ShardedIndex {
+    InvertedIndex *docs;        // the index itself, shared by every worker
+    int numShards;
+    int shardBits;
+    ShardWorker *workers;
+    pthread_t *threads;
+    pthread_mutex_t lock;
+    pthread_cond_t start;
+    pthread_cond_t done;
+    pthread_mutex_t queryLock;  // one query at a time
+    uint64_t generation;        // bumped per query to wake the workers
+    int pending;                // workers still probing
+    bool stop;
+    Fingerprint *partHashes;    // the query being run, grouped by shard
+    int *partPos;
+    uint8_t *partShard;         // scratch: each query hash's shard
+    int partCap;
+} ShardedIndex;
+
+// --- HASH FAMILY ---
+// All fingerprint arithmetic goes through these helpers so the rest of the
+// engine does not care which family was compiled in.
+
+#if HASH_M61
+// x mod 2^61-1 using only shifts and adds (x < 2^122).
+uint64_t m61_reduce(unsigned __int128 x) {
+    uint64_t r = (uint64_t)(x & MOD61) + (uint64_t)(x >> 61);
+    r = (r & MOD61) + (r >> 61);
+    return r >= MOD61 ? r - MOD61 : r;
+}
+
+Fingerprint fp_const(long long v) { return (Fingerprint){(uint64_t)v}; }
+
+Fingerprint fp_push(Fingerprint h, int c) {
+    return (Fingerprint){m61_reduce((unsigned __int128)h.h1 * BASE + (unsigned)c)};
+}
+
+Fingerprint fp_mul(Fingerprint a, Fingerprint b) {
+    return (Fingerprint){m61_reduce((unsigned __int128)a.h1 * b.h1)};
+}
+
+Fingerprint fp_add(Fingerprint a, Fingerprint b) {
+    uint64_t r = a.h1 + b.h1;
+    return (Fingerprint){r >= MOD61 ? r - MOD61 : r};
+}
+
+Fingerprint fp_sub(Fingerprint a, Fingerprint b) {
+    return (Fingerprint){a.h1 >= b.h1 ? a.h1 - b.h1 : a.h1 + MOD61 - b.h1};
+}
+
+bool fp_equal(Fingerprint a, Fingerprint b) {
+    return a.h1 == b.h1;
+}
+
+// Exact 64-bit encoding of a fingerprint.
+uint64_t fp_key(Fingerprint f) {
+    return f.h1;
+}
+#else
+Fingerprint fp_const(long long v) { return (Fingerprint){v, v}; }
+
+Fingerprint fp_push(Fingerprint h, int c) {
+    return (Fingerprint){(h.h1 * BASE + c) % MOD1, (h.h2 * BASE + c) % MOD2};
+}
+
+Fingerprint fp_mul(Fingerprint a, Fingerprint b) {
+    return (Fingerprint){(a.h1 * b.h1) % MOD1, (a.h2 * b.h2) % MOD2};
+}
+
+Fingerprint fp_add(Fingerprint a, Fingerprint b) {
+    return (Fingerprint){(a.h1 + b.h1) % MOD1, (a.h2 + b.h2) % MOD2};
+}
+
+Fingerprint fp_sub(Fingerprint a, Fingerprint b) {
+    return (Fingerprint){(a.h1 - b.h1 + MOD1) % MOD1, (a.h2 - b.h2 + MOD2) % MOD2};
+}
+
+bool fp_equal(Fingerprint a, Fingerprint b) {
+    return a.h1 == b.h1 && a.h2 == b.h2;
+}
+
+// Exact 64-bit encoding of a fingerprint (both halves are below 2^30).
+uint64_t fp_key(Fingerprint f) {
+    return ((uint64_t)f.h1 << 32) | (uint64_t)f.h2;
+}
+#endif
+
+// Murmur3 finalizer: spreads fp_key() bits for table indexing.
+uint64_t mix64(uint64_t x) {
+    x ^= x >> 33;
+    x *= 0xFF51AFD7ED558CCDULL;
+    x ^= x >> 33;
+    x *= 0xC4CEB9FE1A85EC53ULL;
+    x ^= x >> 33;
+    return x;
+}
+
+// --- UTILITIES ---
+
+// Function to read entire file content into a string
+char* read_file(const char* filename) {
+    FILE *f = fopen(filename, "rb");
+    if (!f) return NULL;
+    fseek(f, 0, SEEK_END);
+    long length = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    char *buffer = malloc(length + 1);
+    if (buffer) {
+        fread(buffer, 1, length, f);
+        buffer[length] = '\0';
+    }
+    fclose(f);
+    return buffer;
+}
+
+// --- ARENA ---
+// Objects built in an arena (every create_* that takes an Arena *) are
+// released all at once by arena_reset or free_arena; their own free_* is a
+// no-op. Pass NULL to any of them to use the heap instead.
+
+#define ARENA_BLOCK_SIZE (1 << 20)
+#define ARENA_HEADER 64 // block header padded to a cache line so data stays 64-byte aligned
+
+Arena* create_arena(size_t blockSize) {
+    Arena *a = malloc(sizeof(Arena));
+    a->head = a->cur = NULL;
+    a->blockSize = blockSize ? blockSize : ARENA_BLOCK_SIZE;
+    return a;
+}
+
+static ArenaBlock* arena_new_block(Arena *a, size_t need) {
+    size_t size = need > a->blockSize ? need : a->blockSize;
+    size = (size + 63) & ~(size_t)63;
+    ArenaBlock *b = aligned_alloc(64, ARENA_HEADER + size);
+    b->size = size;
+    b->used = 0;
+    b->next = NULL;
+    return b;
+}
+
+// size bytes aligned to align (a power of two, at most 64).
+void* arena_alloc(Arena *a, size_t size, size_t align) {
+    for (;;) {
+        ArenaBlock *b = a->cur;
+        if (b) {
+            size_t start = (b->used + align - 1) & ~(align - 1);
+            if (start + size <= b->size) {
+                b->used = start + size;
+                return (char *)b + ARENA_HEADER + start;
+            }
+        }
+        // Move on to the next kept block, or chain in a new one big enough.
+        ArenaBlock *next = b ? b->next : a->head;
+        if (!next || next->size < size) {
+            ArenaBlock *fresh = arena_new_block(a, size);
+            fresh->next = next;
+            if (b) b->next = fresh; else a->head = fresh;
+            next = fresh;
+        }
+        next->used = 0;
+        a->cur = next;
+    }
+}
+
+// Forgets every allocation but keeps the blocks for the next comparison.
+void arena_reset(Arena *a) {
+    for (ArenaBlock *b = a->head; b; b = b->next) b->used = 0;
+    a->cur = a->head;
+}
+
+void free_arena(Arena *a) {
+    if (!a) return;
+    for (ArenaBlock *b = a->head, *next; b; b = next) {
+        next = b->next;
+        free(b);
+    }
+    free(a);
+}
+
+// Bytes held by the arena's blocks.
+size_t arena_footprint(const Arena *a) {
+    size_t total = 0;
+    for (const ArenaBlock *b = a->head; b; b = b->next) total += b->size;
+    return total;
+}
+
+// Heap or arena, chosen by the owner of the object being built.
+static void* mem_alloc(Arena *a, size_t size) {
+    return a ? arena_alloc(a, size, 16) : malloc(size);
+}
+
+static void* mem_calloc(Arena *a, size_t size) {
+    if (!a) return calloc(1, size);
+    void *p = arena_alloc(a, size, 16);
+    memset(p, 0, size);
+    return p;
+}
+
+static void mem_free(Arena *a, void *p) {
+    if (!a) free(p);
+}
+
+static void* mem_realloc(Arena *a, void *p, size_t oldSize, size_t newSize) {
+    if (!a) return realloc(p, newSize);
+    void *q = arena_alloc(a, newSize, 16);
+    if (p) memcpy(q, p, oldSize < newSize ? oldSize : newSize);
+    return q;
+}
+
+// --- PREPROCESSING ---
+// Lowercases alphanumerics and collapses every run of other bytes into one
+// space (leading runs are dropped). A byte survives iff it is alnum or the
+// byte before it was, which is what lets the SIMD kernels work block-wise.
+
+typedef size_t (*PreprocessKernel)(const char *text, size_t len, char *clean);
+
+// Byte-at-a-time reference; also finishes the tail for the vector kernels.
+size_t preprocess_scalar_from(const char *text, size_t i, size_t len, char *clean, size_t j) {
+    for (; i < len; i++) {
+        if (isalnum(text[i])) clean[j++] = (char)tolower(text[i]);
+        else if (j > 0 && clean[j-1] != ' ') clean[j++] = ' ';
+    }
+    return j;
+}
+
+size_t preprocess_scalar(const char *text, size_t len, char *clean) {
+    return preprocess_scalar_from(text, 0, len, clean, 0);
+}
+
+#ifdef HAVE_X86_SIMD
+// compact_lut[m] lists the indices of the set bits of m, padded with 0x80 so
+// pshufb zeroes the unused lanes.
+static unsigned char compact_lut[256][8];
+
+void init_compact_lut(void) {
+    for (int m = 0; m < 256; m++) {
+        int k = 0;
+        for (int b = 0; b < 8; b++) if (m & (1 << b)) compact_lut[m][k++] = (unsigned char)b;
+        while (k < 8) compact_lut[m][k++] = 0x80;
+    }
+}
+
+// Writes the bytes of the low 8 lanes of v selected by keep; returns the count.
+__attribute__((target("sse4.2,popcnt")))
+static inline int compact8(__m128i v, unsigned keep, char *out) {
+    __m128i shuf = _mm_loadl_epi64((const __m128i *)compact_lut[keep]);
+    _mm_storel_epi64((__m128i *)out, _mm_shuffle_epi8(v, shuf));
+    return __builtin_popcount(keep);
+}
+
+// Lowercased alnum bytes, everything else as ' '; *alnum gets the class mask.
+__attribute__((target("sse4.2,popcnt")))
+static inline __m128i classify16(__m128i v, __m128i *alnum) {
+    __m128i lower = _mm_or_si128(v, _mm_set1_epi8(0x20));
+    __m128i letter = _mm_and_si128(_mm_cmpgt_epi8(lower, _mm_set1_epi8('a' - 1)),
+                                   _mm_cmplt_epi8(lower, _mm_set1_epi8('z' + 1)));
+    __m128i digit = _mm_and_si128(_mm_cmpgt_epi8(v, _mm_set1_epi8('0' - 1)),
+                                  _mm_cmplt_epi8(v, _mm_set1_epi8('9' + 1)));
+    *alnum = _mm_or_si128(letter, digit);
+    return _mm_blendv_epi8(_mm_set1_epi8(' '), lower, *alnum);
+}
+
+__attribute__((target("sse4.2,popcnt")))
+size_t preprocess_sse42(const char *text, size_t len, char *clean) {
+    size_t i = 0, j = 0;
+    unsigned carry = 0; // was the byte before this block alnum?
+    for (; i + 16 <= len; i += 16) {
+        __m128i alnum;
+        __m128i out = classify16(_mm_loadu_si128((const __m128i *)(text + i)), &alnum);
+        unsigned m = (unsigned)_mm_movemask_epi8(alnum);
+        unsigned keep = (m | (m << 1) | carry) & 0xFFFF;
+        carry = m >> 15;
+        if (keep == 0xFFFF) {
+            _mm_storeu_si128((__m128i *)(clean + j), out);
+            j += 16;
+        } else if (keep) {
+            j += compact8(out, keep & 0xFF, clean + j);
+            j += compact8(_mm_srli_si128(out, 8), keep >> 8, clean + j);
+        }
+    }
+    return preprocess_scalar_from(text, i, len, clean, j);
+}
+
+__attribute__((target("avx2,popcnt")))
+size_t preprocess_avx2(const char *text, size_t len, char *clean) {
+    size_t i = 0, j = 0;
+    unsigned carry = 0;
+    for (; i + 32 <= len; i += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(text + i));
+        __m256i lower = _mm256_or_si256(v, _mm256_set1_epi8(0x20));
+        __m256i letter = _mm256_and_si256(_mm256_cmpgt_epi8(lower, _mm256_set1_epi8('a' - 1)),
+                                          _mm256_cmpgt_epi8(_mm256_set1_epi8('z' + 1), lower));
+        __m256i digit = _mm256_and_si256(_mm256_cmpgt_epi8(v, _mm256_set1_epi8('0' - 1)),
+                                         _mm256_cmpgt_epi8(_mm256_set1_epi8('9' + 1), v));
+        __m256i alnum = _mm256_or_si256(letter, digit);
+        __m256i out = _mm256_blendv_epi8(_mm256_set1_epi8(' '), lower, alnum);
+        uint32_t m = (uint32_t)_mm256_movemask_epi8(alnum);
+        uint32_t keep = m | (m << 1) | carry;
+        carry = m >> 31;
+        if (keep == 0xFFFFFFFFu) {
+            _mm256_storeu_si256((__m256i *)(clean + j), out);
+            j += 32;
+        } else if (keep) {
+            __m128i lo = _mm256_castsi256_si128(out);
+            __m128i hi = _mm256_extracti128_si256(out, 1);
+            j += compact8(lo, keep & 0xFF, clean + j);
+            j += compact8(_mm_srli_si128(lo, 8), (keep >> 8) & 0xFF, clean + j);
+            j += compact8(hi, (keep >> 16) & 0xFF, clean + j);
+            j += compact8(_mm_srli_si128(hi, 8), keep >> 24, clean + j);
+        }
+    }
+    return preprocess_scalar_from(text, i, len, clean, j);
+}
+#endif
+
+PreprocessKernel select_preprocess_kernel(void) {
+#ifdef HAVE_X86_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("popcnt")) {
+        if (__builtin_cpu_supports("avx2")) { init_compact_lut(); return preprocess_avx2; }
+        if (__builtin_cpu_supports("sse4.2")) { init_compact_lut(); return preprocess_sse42; }
+    }
+#endif
+    return preprocess_scalar;
+}
+
+char* preprocess(Arena *arena, const char *text) {
+    static PreprocessKernel kernel = NULL;
+    if (!kernel) kernel = select_preprocess_kernel();
+    size_t len = strlen(text);
+    char *clean = mem_alloc(arena, len + 1);
+    size_t j = kernel(text, len, clean);
+    clean[j] = '\0';
+    return clean;
+}
+
+// --- TOKEN INTERNING ---
+
+uint64_t str_hash(const char *s, int len) {
+    uint64_t h = 0x9E3779B97F4A7C15ULL ^ (uint64_t)len;
+    int i = 0;
+    for (; i + 8 <= len; i += 8) {
+        uint64_t v;
+        memcpy(&v, s + i, 8);
+        h = (h ^ v) * 0xFF51AFD7ED558CCDULL;
+        h ^= h >> 32;
+    }
+    uint64_t v = 0;
+    memcpy(&v, s + i, len - i);
+    h = (h ^ v) * 0xC4CEB9FE1A85EC53ULL;
+    return h ^ (h >> 29);
+}
+
+Fingerprint word_hash(const char *word, int len) {
+    Fingerprint h = fp_const(0);
+    for (int j = 0; j < len; j++) h = fp_push(h, word[j]);
+    return h;
+}
+
+Lexicon* create_lexicon() {
+    Lexicon *lex = calloc(1, sizeof(Lexicon));
+    lex->charsCap = 4096;
+    lex->chars = malloc(lex->charsCap);
+    lex->cap = 1024;
+    lex->words = malloc(sizeof(TokenSpan) * lex->cap);
+    lex->hash = malloc(sizeof(Fingerprint) * lex->cap);
+    lex->keyHash = malloc(sizeof(uint32_t) * lex->cap);
+    lex->slotMask = 2 * lex->cap - 1;
+    lex->slots = calloc(lex->slotMask + 1, sizeof(uint32_t));
+    return lex;
+}
+
+void free_lexicon(Lexicon *lex) {
+    if (!lex) return;
+    free(lex->chars); free(lex->words); free(lex->hash); free(lex->keyHash); free(lex->slots);
+    free(lex);
+}
+
+const char* lexicon_word(const Lexicon *lex, uint32_t id, int *len) {
+    *len = lex->words[id].length;
+    return lex->chars + lex->words[id].offset;
+}
+
+// Doubles the ID arrays and rebuilds the slot table (kept at most half full).
+static void lexicon_grow(Lexicon *lex) {
+    lex->cap *= 2;
+    lex->words = realloc(lex->words, sizeof(TokenSpan) * lex->cap);
+    lex->hash = realloc(lex->hash, sizeof(Fingerprint) * lex->cap);
+    lex->keyHash = realloc(lex->keyHash, sizeof(uint32_t) * lex->cap);
+    free(lex->slots);
+    lex->slotMask = 2 * lex->cap - 1;
+    lex->slots = calloc(lex->slotMask + 1, sizeof(uint32_t));
+    for (uint32_t id = 0; id < lex->count; id++) {
+        uint32_t idx = lex->keyHash[id] & lex->slotMask;
+        while (lex->slots[idx]) idx = (idx + 1) & lex->slotMask;
+        lex->slots[idx] = id + 1;
+    }
+}
+
+// ID of word s[0..len), adding it on first sight.
+uint32_t lexicon_intern(Lexicon *lex, const char *s, int len) {
+    uint32_t kh = (uint32_t)str_hash(s, len);
+    uint32_t idx = kh & lex->slotMask;
+    while (lex->slots[idx]) {
+        uint32_t id = lex->slots[idx] - 1;
+        if (lex->keyHash[id] == kh && lex->words[id].length == len &&
+            memcmp(lex->chars + lex->words[id].offset, s, len) == 0) return id;
+        idx = (idx + 1) & lex->slotMask;
+    }
+
+    if (lex->count == lex->cap) {
+        lexicon_grow(lex);
+        idx = kh & lex->slotMask;
+        while (lex->slots[idx]) idx = (idx + 1) & lex->slotMask;
+    }
+    if (lex->charsLen + len > lex->charsCap) {
+        while (lex->charsLen + len > lex->charsCap) lex->charsCap *= 2;
+        lex->chars = realloc(lex->chars, lex->charsCap);
+    }
+    uint32_t id = lex->count++;
+    memcpy(lex->chars + lex->charsLen, s, len);
+    lex->words[id] = (TokenSpan){(int)lex->charsLen, len};
+    lex->hash[id] = word_hash(s, len);
+    lex->keyHash[id] = kh;
+    lex->charsLen += len;
+    if (len > lex->maxLen) lex->maxLen = len;
+    lex->slots[idx] = id + 1;
+    return id;
+}
+
+// Splits the cleaned text on its single spaces and interns every word. The
+// ID array is sized from the space count, so there is no word or length
+// limit, and clean is no longer needed afterwards.
+int tokenize(Arena *arena, const char *clean, Lexicon *lex, TokenList *tl) {
+    int cap = 1;
+    for (const char *p = clean; *p; p++) if (*p == ' ') cap++;
+    tl->lex = lex;
+    tl->arena = arena;
+    tl->ids = mem_alloc(arena, sizeof(uint32_t) * cap);
+    tl->count = 0;
+    int i = 0;
+    while (clean[i]) {
+        int start = i;
+        while (clean[i] && clean[i] != ' ') i++;
+        tl->ids[tl->count++] = lexicon_intern(lex, clean + start, i - start);
+        if (clean[i]) i++;
+    }
+    return tl->count;
+}
+
+void free_tokens(TokenList *tl) {
+    mem_free(tl->arena, tl->ids);
+    tl->ids = NULL;
+    tl->count = 0;
+}
+
+// Characters in the n-word shingle at start, separators included.
+int shingle_length(const TokenList *tl, int start, int n) {
+    int len = n - 1;
+    for (int k = 0; k < n; k++) len += tl->lex->words[tl->ids[start + k]].length;
+    return len;
+}
+
+// Writes the text of the n-word shingle at start into buf, truncated to fit
+// cap bytes; returns its length.
+int shingle_text(const TokenList *tl, int start, int n, char *buf, int cap) {
+    int len = 0;
+    for (int k = 0; k < n && len < cap - 1; k++) {
+        if (k > 0) buf[len++] = ' ';
+        int wl;
+        const char *word = lexicon_word(tl->lex, tl->ids[start + k], &wl);
+        if (wl > cap - 1 - len) wl = cap - 1 - len;
+        memcpy(buf + len, word, wl);
+        len += wl;
+    }
+    buf[len] = '\0';
+    return len;
+}
+
+// --- BLOOM FILTER ---
+
+#define BLOOM_BLOCK_BITS 512
+
+// Sized for expected keys at the target false-positive rate: k = log2(1/fpr)
+// probes and 1.44 * k bits per key, padded for the uneven block loads that
+// blocking causes (empirically ~10% at k = 7, growing ~10% per extra probe).
+BloomFilter* create_bloom(Arena *arena, size_t expected, double fpr) {
+    BloomFilter *bf = mem_alloc(arena, sizeof(BloomFilter));
+    bf->arena = arena;
+    double log2inv = log(1.0 / fpr) / log(2.0);
+    bf->k = (int)(log2inv + 0.5);
+    if (bf->k < 1) bf->k = 1;
+    if (bf->k > 16) bf->k = 16;
+    double pad = 1.1 + 0.1 * (bf->k - 7);
+    if (pad < 1.05) pad = 1.05;
+    double bits = (double)(expected ? expected : 1) * 1.44 * log2inv * pad;
+    bf->numBlocks = (uint32_t)(bits / BLOOM_BLOCK_BITS) + 1;
+    size_t bytes = (size_t)bf->numBlocks * 64;
+    bf->blocks = arena ? arena_alloc(arena, bytes, 64) : aligned_alloc(64, bytes);
+    memset(bf->blocks, 0, (size_t)bf->numBlocks * 64);
+    return bf;
+}
+
+void free_bloom(BloomFilter *bf) {
+    if (!bf || bf->arena) return;
+    free(bf->blocks);
+    free(bf);
+}
+
+// Block chosen from the high half of the hash; the k in-block bit positions
+// come from double hashing on a second mix.
+static inline uint64_t* bloom_block(const BloomFilter *bf, uint64_t h) {
+    return bf->blocks + (((h >> 32) * bf->numBlocks) >> 32) * 8;
+}
+
+void bloom_add(BloomFilter *bf, Fingerprint f) {
+    uint64_t h = mix64(fp_key(f));
+    uint64_t *block = bloom_block(bf, h);
+    uint64_t g = mix64(h);
+    uint32_t a = (uint32_t)g, b = (uint32_t)(g >> 32) | 1;
+    for (int i = 0; i < bf->k; i++) {
+        uint32_t bit = (a + i * b) & (BLOOM_BLOCK_BITS - 1);
+        block[bit >> 6] |= 1ULL << (bit & 63);
+    }
+}
+
+bool bloom_check(BloomFilter *bf, Fingerprint f) {
+    uint64_t h = mix64(fp_key(f));
+    const uint64_t *block = bloom_block(bf, h);
+    uint64_t g = mix64(h);
+    uint32_t a = (uint32_t)g, b = (uint32_t)(g >> 32) | 1;
+    for (int i = 0; i < bf->k; i++) {
+        uint32_t bit = (a + i * b) & (BLOOM_BLOCK_BITS - 1);
+        if (!(block[bit >> 6] & (1ULL << (bit & 63)))) return false;
+    }
+    return true;
+}
+
+// --- HASH SETS & FREQUENCY MAP ---
+
+#define GROUP_WIDTH 16
+#define CTRL_EMPTY 0x80
+#define CTRL_DELETED 0xFE
+
+// Bit i set iff ctrl[i] == c, for the 16 control bytes of a group.
+static inline uint32_t group_match(const unsigned char *ctrl, unsigned char c) {
+#ifdef __SSE2__
+    __m128i g = _mm_loadu_si128((const __m128i *)ctrl);
+    return (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(g, _mm_set1_epi8((char)c)));
+#else
+    uint32_t m = 0;
+    for (int i = 0; i < GROUP_WIDTH; i++) if (ctrl[i] == c) m |= 1u << i;
+    return m;
+#endif
+}
+
+// Bit i set iff slot i of the group is empty or deleted (high control bit).
+static inline uint32_t group_match_free(const unsigned char *ctrl) {
+#ifdef __SSE2__
+    return (uint32_t)_mm_movemask_epi8(_mm_loadu_si128((const __m128i *)ctrl));
+#else
+    uint32_t m = 0;
+    for (int i = 0; i < GROUP_WIDTH; i++) if (ctrl[i] & 0x80) m |= 1u << i;
+    return m;
+#endif
+}
+
+static void table_alloc(FpTable *t, size_t capacity) {
+    t->capacity = capacity;
+    t->deleted = 0;
+    t->ctrl = mem_alloc(t->arena, capacity);
+    memset(t->ctrl, CTRL_EMPTY, capacity);
+    t->keys = mem_alloc(t->arena, sizeof(Fingerprint) * capacity);
+    t->vals = t->valSize ? mem_alloc(t->arena, t->valSize * capacity) : NULL;
+}
+
+FpTable* create_table(Arena *arena, size_t valSize, size_t expected) {
+    FpTable *t = mem_alloc(arena, sizeof(FpTable));
+    t->arena = arena;
+    size_t capacity = GROUP_WIDTH;
+    while (capacity / 8 * 7 < expected) capacity *= 2;
+    t->valSize = valSize;
+    t->size = 0;
+    table_alloc(t, capacity);
+    return t;
+}
+
+void free_table(FpTable *t) {
+    if (!t || t->arena) return;
+    free(t->ctrl); free(t->keys); free(t->vals);
+    free(t);
+}
+
+bool table_slot_used(const FpTable *t, size_t slot) {
+    return t->ctrl[slot] < 0x80;
+}
+
+void* table_value(const FpTable *t, size_t slot) {
+    return t->vals + slot * t->valSize;
+}
+
+// Slot holding f, or -1. Groups are visited in triangular order, which covers
+// every group of a power-of-two table; a group with an empty slot ends the probe.
+long table_find(const FpTable *t, Fingerprint f) {
+    uint64_t h = mix64(fp_key(f));
+    unsigned char tag = (unsigned char)(h & 0x7F);
+    size_t groupMask = t->capacity / GROUP_WIDTH - 1;
+    size_t g = (h >> 7) & groupMask;
+    for (size_t step = 1; ; step++) {
+        const unsigned char *ctrl = t->ctrl + g * GROUP_WIDTH;
+        for (uint32_t m = group_match(ctrl, tag); m; m &= m - 1) {
+            size_t slot = g * GROUP_WIDTH + __builtin_ctz(m);
+            if (fp_equal(t->keys[slot], f)) return (long)slot;
+        }
+        if (group_match(ctrl, CTRL_EMPTY)) return -1;
+        g = (g + step) & groupMask;
+    }
+}
+
+// Places a key known to be absent in the first free slot; returns it.
+static size_t table_place(FpTable *t, Fingerprint f) {
+    uint64_t h = mix64(fp_key(f));
+    size_t groupMask = t->capacity / GROUP_WIDTH - 1;
+    size_t g = (h >> 7) & groupMask;
+    for (size_t step = 1; ; step++) {
+        uint32_t free = group_match_free(t->ctrl + g * GROUP_WIDTH);
+        if (free) {
+            size_t slot = g * GROUP_WIDTH + __builtin_ctz(free);
+            if (t->ctrl[slot] == CTRL_DELETED) t->deleted--;
+            t->ctrl[slot] = (unsigned char)(h & 0x7F);
+            t->keys[slot] = f;
+            return slot;
+        }
+        g = (g + step) & groupMask;
+    }
+}
+
+// Rebuilds at newCapacity, dropping tombstones.
+static void table_rehash(FpTable *t, size_t newCapacity) {
+    FpTable old = *t;
+    table_alloc(t, newCapacity);
+    for (size_t i = 0; i < old.capacity; i++) {
+        if (old.ctrl[i] & 0x80) continue;
+        size_t slot = table_place(t, old.keys[i]);
+        if (t->valSize) memcpy(table_value(t, slot), old.vals + i * old.valSize, t->valSize);
+    }
+    mem_free(t->arena, old.ctrl); mem_free(t->arena, old.keys); mem_free(t->arena, old.vals);
+}
+
+// Slot of f, inserting it with a zeroed value if absent.
+size_t table_insert(FpTable *t, Fingerprint f, bool *inserted) {
+    long found = table_find(t, f);
+    if (inserted) *inserted = found < 0;
+    if (found >= 0) return (size_t)found;
+    if (t->size + t->deleted + 1 > t->capacity / 8 * 7) {
+        // Mostly tombstones: clean up in place; otherwise double.
+        table_rehash(t, t->size * 2 < t->capacity / 8 * 7 ? t->capacity : t->capacity * 2);
+    }
+    size_t slot = table_place(t, f);
+    if (t->valSize) memset(table_value(t, slot), 0, t->valSize);
+    t->size++;
+    return slot;
+}
+
+// Removes f if present; its slot becomes a tombstone so probes continue past it.
+bool table_erase(FpTable *t, Fingerprint f) {
+    long slot = table_find(t, f);
+    if (slot < 0) return false;
+    t->ctrl[slot] = CTRL_DELETED;
+    t->size--;
+    t->deleted++;
+    return true;
+}
+
+FingerprintSet* create_set(Arena *arena) {
+    return create_table(arena, 0, 0);
+}
+
+void free_set(FingerprintSet *fs) {
+    free_table(fs);
+}
+
+void set_insert(FingerprintSet *fs, Fingerprint f) {
+    table_insert(fs, f, NULL);
+}
+
+bool set_contains(FingerprintSet *fs, Fingerprint f) {
+    return table_find(fs, f) >= 0;
+}
+
+// --- HEAP RANKING LOGIC ---
+// Counts only ever grow by one, so an entry outside the heap can only enter
+// by overtaking the root, and an entry inside only moves away from the root.
+// Each update is O(log K).
+
+// True if entry a ranks above entry b.
+static bool rank_above(const FreqEntry *a, const FreqEntry *b, TieBreak tie) {
+    if (a->frequency != b->frequency) return a->frequency > b->frequency;
+    if (tie == TIE_PHRASE_LENGTH && a->phraseLen != b->phraseLen) return a->phraseLen > b->phraseLen;
+    return a->firstPos < b->firstPos;
+}
+
+static void heap_place(FreqEntry *entries, TopK *tk, int slot, int idx) {
+    tk->heap[slot] = idx;
+    entries[idx].heapSlot = slot;
+}
+
+static void heap_sift_up(FreqEntry *entries, TopK *tk, int slot) {
+    int idx = tk->heap[slot];
+    while (slot > 0) {
+        int parent = (slot - 1) / 2;
+        if (!rank_above(&entries[tk->heap[parent]], &entries[idx], tk->tie)) break;
+        heap_place(entries, tk, slot, tk->heap[parent]);
+        slot = parent;
+    }
+    heap_place(entries, tk, slot, idx);
+}
+
+static void heap_sift_down(FreqEntry *entries, TopK *tk, int slot) {
+    int idx = tk->heap[slot];
+    for (;;) {
+        int worst = slot, l = 2 * slot + 1, r = l + 1;
+        const FreqEntry *w = &entries[idx];
+        if (l < tk->size && rank_above(w, &entries[tk->heap[l]], tk->tie)) { worst = l; w = &entries[tk->heap[l]]; }
+        if (r < tk->size && rank_above(w, &entries[tk->heap[r]], tk->tie)) worst = r;
+        if (worst == slot) break;
+        heap_place(entries, tk, slot, tk->heap[worst]);
+        slot = worst;
+    }
+    heap_place(entries, tk, slot, idx);
+}
+
+// Re-ranks entry idx after its count went up.
+void topk_update(FreqEntry *entries, TopK *tk, int idx) {
+    if (tk->k <= 0) return;
+    FreqEntry *e = &entries[idx];
+    if (e->heapSlot >= 0) {
+        heap_sift_down(entries, tk, e->heapSlot);
+    } else if (tk->size < tk->k) {
+        tk->heap[tk->size] = idx;
+        heap_sift_up(entries, tk, tk->size++);
+    } else if (rank_above(e, &entries[tk->heap[0]], tk->tie)) {
+        entries[tk->heap[0]].heapSlot = -1;
+        heap_place(entries, tk, 0, idx);
+        heap_sift_down(entries, tk, 0);
+    }
+}
+
+FrequencyMap* create_freq_map(Arena *arena, int k, TieBreak tie) {
+    FrequencyMap *fm = mem_alloc(arena, sizeof(FrequencyMap));
+    fm->arena = arena;
+    fm->index = create_table(arena, sizeof(uint32_t), 0);
+    fm->capacity = 64;
+    fm->count = 0;
+    fm->entries = mem_alloc(arena, sizeof(FreqEntry) * fm->capacity);
+    fm->rank.k = k;
+    fm->rank.heap = mem_alloc(arena, sizeof(int) * (k > 0 ? k : 1));
+    fm->rank.size = 0;
+    fm->rank.tie = tie;
+    return fm;
+}
+
+void free_freq_map(FrequencyMap *fm) {
+    if (!fm || fm->arena) return;
+    free_table(fm->index);
+    free(fm->entries);
+    free(fm->rank.heap);
+    free(fm);
+}
+
+// Counts one more occurrence of f, first seen at token position pos (a
+// phrase of phraseLen characters), and updates the ranking.
+void freq_update(FrequencyMap *fm, Fingerprint f, int pos, int phraseLen) {
+    bool inserted;
+    uint32_t *idx = table_value(fm->index, table_insert(fm->index, f, &inserted));
+    if (inserted) {
+        if (fm->count == fm->capacity) {
+            fm->entries = mem_realloc(fm->arena, fm->entries, sizeof(FreqEntry) * fm->capacity,
+                                      sizeof(FreqEntry) * fm->capacity * 2);
+            fm->capacity *= 2;
+        }
+        *idx = (uint32_t)fm->count;
+        fm->entries[fm->count++] = (FreqEntry){0, pos, phraseLen, -1};
+    }
+    fm->entries[*idx].frequency++;
+    topk_update(fm->entries, &fm->rank, (int)*idx);
+}
+
+static const FreqEntry *rank_sort_entries;
+static TieBreak rank_sort_tie;
+
+static int rank_compare(const void *a, const void *b) {
+    const FreqEntry *x = &rank_sort_entries[*(const int *)a], *y = &rank_sort_entries[*(const int *)b];
+    return rank_above(x, y, rank_sort_tie) ? -1 : rank_above(y, x, rank_sort_tie) ? 1 : 0;
+}
+
+// Copies the current top entries into out (room for k), best first; returns
+// how many there are.
+int freq_top(const FrequencyMap *fm, FreqEntry *out) {
+    int count = fm->rank.size;
+    int *order = mem_alloc(fm->arena, sizeof(int) * (count + 1));
+    memcpy(order, fm->rank.heap, sizeof(int) * count);
+    rank_sort_entries = fm->entries;
+    rank_sort_tie = fm->rank.tie;
+    qsort(order, count, sizeof(int), rank_compare);
+    for (int i = 0; i < count; i++) out[i] = fm->entries[order[i]];
+    mem_free(fm->arena, order);
+    return count;
+}
+
+// --- SPACE-SAVING SKETCH ---
+// Reuses the ranking heap with K = m: it then holds every counter with the
+// lowest-ranked one at the root, which is exactly the counter Space-Saving
+// replaces. The replacement only raises its count, so it sifts down.
+
+SpaceSaving* create_space_saving(Arena *arena, int k, int m, TieBreak tie) {
+    SpaceSaving *ss = mem_alloc(arena, sizeof(SpaceSaving));
+    if (m < 1) m = 1;
+    ss->arena = arena;
+    ss->index = create_table(arena, sizeof(uint32_t), m);
+    ss->entries = mem_alloc(arena, sizeof(FreqEntry) * m);
+    ss->fps = mem_alloc(arena, sizeof(Fingerprint) * m);
+    ss->error = mem_alloc(arena, sizeof(int) * m);
+    ss->m = m;
+    ss->count = 0;
+    ss->k = k;
+    ss->order.k = m;
+    ss->order.heap = mem_alloc(arena, sizeof(int) * m);
+    ss->order.size = 0;
+    ss->order.tie = tie;
+    ss->total = 0;
+    return ss;
+}
+
+void free_space_saving(SpaceSaving *ss) {
+    if (!ss || ss->arena) return;
+    free_table(ss->index);
+    free(ss->entries);
+    free(ss->fps);
+    free(ss->error);
+    free(ss->order.heap);
+    free(ss);
+}
+
+// Counts one more occurrence of f; evicts the smallest counter when all m
+// are in use. O(log m).
+void ss_update(SpaceSaving *ss, Fingerprint f, int pos, int phraseLen) {
+    ss->total++;
+    long slot = table_find(ss->index, f);
+    int idx;
+    if (slot >= 0) {
+        idx = (int)*(uint32_t *)table_value(ss->index, slot);
+    } else if (ss->count < ss->m) {
+        idx = ss->count++;
+        ss->entries[idx] = (FreqEntry){0, pos, phraseLen, -1};
+        ss->error[idx] = 0;
+    } else {
+        idx = ss->order.heap[0];
+        FreqEntry *e = &ss->entries[idx];
+        table_erase(ss->index, ss->fps[idx]);
+        ss->error[idx] = e->frequency;
+        e->firstPos = pos;
+        e->phraseLen = phraseLen;
+    }
+    if (slot < 0) {
+        bool inserted;
+        *(uint32_t *)table_value(ss->index, table_insert(ss->index, f, &inserted)) = (uint32_t)idx;
+        ss->fps[idx] = f;
+    }
+    ss->entries[idx].frequency++;
+    topk_update(ss->entries, &ss->order, idx);
+}
+
+// Upper bound on how far any reported frequency exceeds the true count.
+long long ss_error_bound(const SpaceSaving *ss) {
+    return ss->count < ss->m ? 0 : ss->total / ss->m;
+}
+
+// Copies the k highest counters into out, best first; returns how many.
+int ss_top(const SpaceSaving *ss, FreqEntry *out) {
+    int count = ss->order.size;
+    int *order = mem_alloc(ss->arena, sizeof(int) * (count + 1));
+    memcpy(order, ss->order.heap, sizeof(int) * count);
+    rank_sort_entries = ss->entries;
+    rank_sort_tie = ss->order.tie;
+    qsort(order, count, sizeof(int), rank_compare);
+    if (count > ss->k) count = ss->k;
+    for (int i = 0; i < count; i++) out[i] = ss->entries[order[i]];
+    mem_free(ss->arena, order);
+    return count;
+}
+
+// --- PHRASE TALLY ---
+// What the suspect scan counts matches into: the exact FrequencyMap, or the
+// fixed-memory Space-Saving sketch for book- and corpus-sized inputs.
+
+#if USE_SPACE_SAVING
+typedef SpaceSaving PhraseTally;
+
+PhraseTally* tally_create(Arena *arena, int k, TieBreak tie) {
+    return create_space_saving(arena, k, (k > 0 ? k : 1) * SPACE_SAVING_PER_K, tie);
+}
+
+void tally_update(PhraseTally *t, Fingerprint f, int pos, int phraseLen) { ss_update(t, f, pos, phraseLen); }
+int tally_top(const PhraseTally *t, FreqEntry *out) { return ss_top(t, out); }
+void tally_free(PhraseTally *t) { free_space_saving(t); }
+#else
+typedef FrequencyMap PhraseTally;
+
+PhraseTally* tally_create(Arena *arena, int k, TieBreak tie) { return create_freq_map(arena, k, tie); }
+void tally_update(PhraseTally *t, Fingerprint f, int pos, int phraseLen) { freq_update(t, f, pos, phraseLen); }
+int tally_top(const PhraseTally *t, FreqEntry *out) { return freq_top(t, out); }
+void tally_free(PhraseTally *t) { free_freq_map(t); }
+#endif
+
+// --- BINARY FUSE FILTER ---
+// Alternative gatekeeper for a frozen reference set (Graf & Lemire, "Binary
+// Fuse Filters"). Each key hashes to one slot in each of three consecutive
+// segments; construction peels keys that own a slot alone and then assigns
+// slots in reverse so the three fingerprints XOR to the key's 8-bit tag.
+
+#define FUSE_MAX_ATTEMPTS 100
+
+static inline uint32_t fuse_slot(int index, uint64_t hash, const FuseFilter *ff) {
+    uint64_t h = (uint64_t)(((unsigned __int128)hash * ff->segmentCountLength) >> 64);
+    h += (uint64_t)index * ff->segmentLength;
+    uint64_t hh = hash & ((1ULL << 36) - 1);
+    h ^= (hh >> (36 - 18 * index)) & ff->segmentLengthMask;
+    return (uint32_t)h;
+}
+
+static inline uint8_t fuse_tag(uint64_t hash) {
+    return (uint8_t)(hash ^ (hash >> 32));
+}
+
+// Geometry from the reference implementation's sizing rules for arity 3.
+static void fuse_allocate(FuseFilter *ff, uint32_t size) {
+    uint32_t segLen = size == 0 ? 4 : 1u << (int)floor(log((double)size) / log(3.33) + 2.25);
+    if (segLen > 262144) segLen = 262144;
+    double factor = size <= 1 ? 0 : fmax(1.125, 0.875 + 0.25 * log(1000000.0) / log((double)size));
+    uint32_t capacity = (uint32_t)round(size * factor);
+    uint32_t segs = (capacity + segLen - 1) / segLen;
+    ff->size = size;
+    ff->segmentLength = segLen;
+    ff->segmentLengthMask = segLen - 1;
+    ff->segmentCount = segs <= 2 ? 1 : segs - 2;
+    ff->arrayLength = (ff->segmentCount + 2) * segLen;
+    ff->segmentCountLength = ff->segmentCount * segLen;
+    ff->fingerprints = mem_calloc(ff->arena, ff->arrayLength);
+}
+
+void free_fuse_filter(FuseFilter *ff) {
+    if (!ff || ff->arena) return;
+    free(ff->fingerprints);
+    free(ff);
+}
+
+// Builds the filter from distinct 64-bit keys; NULL if every seed failed.
+FuseFilter* create_fuse_filter(Arena *arena, const uint64_t *keys, uint32_t size) {
+    FuseFilter *ff = mem_alloc(arena, sizeof(FuseFilter));
+    ff->arena = arena;
+    fuse_allocate(ff, size);
+    uint32_t cap = ff->arrayLength;
+    uint32_t *count = mem_alloc(arena, sizeof(uint32_t) * cap);
+    uint64_t *xorHash = mem_alloc(arena, sizeof(uint64_t) * cap);
+    uint32_t *queue = mem_alloc(arena, sizeof(uint32_t) * cap);
+    uint64_t *stackHash = mem_alloc(arena, sizeof(uint64_t) * (size + 1));
+    uint8_t *stackSlot = mem_alloc(arena, size + 1);
+    uint64_t seedState = 0x726B2B9D438B9D4DULL;
+    uint32_t stackSize = 0;
+
+    for (int attempt = 0; attempt < FUSE_MAX_ATTEMPTS; attempt++) {
+        ff->seed = mix64(seedState += 0x9E3779B97F4A7C15ULL);
+        memset(count, 0, sizeof(uint32_t) * cap);
+        memset(xorHash, 0, sizeof(uint64_t) * cap);
+        for (uint32_t i = 0; i < size; i++) {
+            uint64_t hash = mix64(keys[i] + ff->seed);
+            for (int j = 0; j < 3; j++) {
+                uint32_t slot = fuse_slot(j, hash, ff);
+                count[slot]++;
+                xorHash[slot] ^= hash;
+            }
+        }
+
+        // Peel: a slot hit by exactly one key determines that key.
+        uint32_t queued = 0;
+        for (uint32_t i = 0; i < cap; i++) if (count[i] == 1) queue[queued++] = i;
+        stackSize = 0;
+        while (queued > 0) {
+            uint32_t slot = queue[--queued];
+            if (count[slot] != 1) continue;
+            uint64_t hash = xorHash[slot];
+            for (int j = 0; j < 3; j++) {
+                uint32_t other = fuse_slot(j, hash, ff);
+                if (other == slot) stackSlot[stackSize] = (uint8_t)j;
+                count[other]--;
+                xorHash[other] ^= hash;
+                if (count[other] == 1) queue[queued++] = other;
+            }
+            stackHash[stackSize++] = hash;
+        }
+        if (stackSize == size) break;
+    }
+
+    if (stackSize != size) {
+        free_fuse_filter(ff);
+        ff = NULL;
+    } else {
+        for (uint32_t i = stackSize; i-- > 0; ) {
+            uint64_t hash = stackHash[i];
+            uint32_t s0 = fuse_slot(0, hash, ff), s1 = fuse_slot(1, hash, ff), s2 = fuse_slot(2, hash, ff);
+            uint32_t own = stackSlot[i] == 0 ? s0 : stackSlot[i] == 1 ? s1 : s2;
+            ff->fingerprints[own] = 0;
+            ff->fingerprints[own] = fuse_tag(hash) ^ ff->fingerprints[s0] ^ ff->fingerprints[s1] ^ ff->fingerprints[s2];
+        }
+    }
+    mem_free(arena, count); mem_free(arena, xorHash); mem_free(arena, queue);
+    mem_free(arena, stackHash); mem_free(arena, stackSlot);
+    return ff;
+}
+
+// Freezes the contents of a fingerprint set into a fuse filter.
+FuseFilter* fuse_filter_from_set(Arena *arena, const FingerprintSet *fs) {
+    uint64_t *keys = mem_calloc(arena, sizeof(uint64_t) * (fs->size + 1));
+    uint32_t size = 0;
+    for (size_t i = 0; i < fs->capacity; i++) {
+        if (table_slot_used(fs, i)) keys[size++] = fp_key(fs->keys[i]);
+    }
+    FuseFilter *ff = create_fuse_filter(arena, keys, size);
+    mem_free(arena, keys);
+    return ff;
+}
+
+bool fuse_check(const FuseFilter *ff, Fingerprint f) {
+    uint64_t hash = mix64(fp_key(f) + ff->seed);
+    uint8_t tag = fuse_tag(hash);
+    tag ^= ff->fingerprints[fuse_slot(0, hash, ff)];
+    tag ^= ff->fingerprints[fuse_slot(1, hash, ff)];
+    tag ^= ff->fingerprints[fuse_slot(2, hash, ff)];
+    return tag == 0;
+}
+
+// The filter consulted before set_contains in the scan loop.
+#if USE_FUSE_FILTER
+typedef FuseFilter Gatekeeper;
+
+bool gate_check(const Gatekeeper *g, Fingerprint f) {
+    return !g || fuse_check(g, f);
+}
+#else
+typedef BloomFilter Gatekeeper;
+
+bool gate_check(const Gatekeeper *g, Fingerprint f) {
+    return bloom_check((BloomFilter *)g, f);
+}
+#endif
+
+// --- CORE LOGIC ---
+
+Fingerprint get_double_hash(const TokenList *tl, int start, int n) {
+    Fingerprint h = fp_const(0);
+    for (int i = 0; i < n; i++) {
+        int len;
+        const char *word = lexicon_word(tl->lex, tl->ids[start + i], &len);
+        for (int j = 0; j < len; j++) h = fp_push(h, word[j]);
+        if (i < n - 1) h = fp_push(h, ' ');
+    }
+    return h;
+}
+
+// --- ROLLING RABIN-KARP ---
+// A shingle is "w0 w1 ... wn-1" with single spaces, hashed as one character
+// polynomial. Keeping the previous shingle's hash and BASE^k lets us slide by
+// one word in O(1): strip the leading "w0 " term and append " wn". Word hashes
+// and lengths come from the lexicon, so shingles roll over word IDs and no
+// character is read twice.
+
+// pow[k] = BASE^k, for k in [0, maxLen]
+Fingerprint* create_power_table(Arena *arena, int maxLen) {
+    Fingerprint *pow = mem_alloc(arena, sizeof(Fingerprint) * (maxLen + 1));
+    pow[0] = fp_const(1);
+    for (int k = 1; k <= maxLen; k++) pow[k] = fp_push(pow[k-1], 0);
+    return pow;
+}
+
+typedef struct {
+    Fingerprint h;          // hash of the current shingle
+    int len;                // characters in the current shingle, spaces included
+    const Fingerprint *pow;
+} RollingHash;
+
+void rolling_init(RollingHash *rh, const Fingerprint *pow) {
+    rh->h = fp_const(0);
+    rh->len = 0;
+    rh->pow = pow;
+}
+
+// Append a word (hash wh, length wl) at the end of the shingle.
+void rolling_push_word(RollingHash *rh, Fingerprint wh, int wl) {
+    if (rh->len > 0) { rh->h = fp_push(rh->h, ' '); rh->len++; }
+    rh->h = fp_add(fp_mul(rh->h, rh->pow[wl]), wh);
+    rh->len += wl;
+}
+
+// Remove the leading word (hash wh, length wl) from the shingle.
+void rolling_pop_word(RollingHash *rh, Fingerprint wh, int wl) {
+    if (rh->len == wl) { rh->h = fp_const(0); rh->len = 0; return; }
+    int tail = rh->len - wl - 1;
+    rh->h = fp_sub(rh->h, fp_mul(fp_push(wh, ' '), rh->pow[tail]));
+    rh->len = tail;
+}
+
+// --- WINNOWING ---
+// Robust winnowing (Schleimer et al.): each window of w consecutive hashes
+// selects its minimum, right-most on ties, and a selection is only emitted
+// when it differs from the previous one. Amortized O(1) per window.
+
+void winnower_init(Arena *arena, Winnower *wn, int w) {
+    wn->w = w;
+    wn->arena = arena;
+    wn->ring = mem_alloc(arena, sizeof(WinnowedFingerprint) * (w > 0 ? w : 1));
+    wn->head = 0;
+    wn->size = 0;
+    wn->seen = 0;
+    wn->lastPos = -1;
+}
+
+void winnower_free(Winnower *wn) {
+    mem_free(wn->arena, wn->ring);
+    wn->ring = NULL;
+}
+
+// Feeds the hash of the shingle at pos. Returns true and fills *out when the
+// window ending here selects a new fingerprint.
+bool winnower_push(Winnower *wn, Fingerprint f, int pos, WinnowedFingerprint *out) {
+    int w = wn->w;
+    // Slide the window, then drop entries that can never be a minimum again
+    // (>= so that ties keep the right-most one).
+    if (wn->size > 0 && wn->ring[wn->head].pos <= pos - w) { wn->head = (wn->head + 1) % w; wn->size--; }
+    while (wn->size > 0 && wn->ring[(wn->head + wn->size - 1) % w].fp.h1 >= f.h1) wn->size--;
+    wn->ring[(wn->head + wn->size) % w] = (WinnowedFingerprint){f, pos};
+    wn->size++;
+    if (++wn->seen < w) return false;
+
+    WinnowedFingerprint *front = &wn->ring[wn->head];
+    if (front->pos == wn->lastPos) return false;
+    wn->lastPos = front->pos;
+    *out = *front;
+    return true;
+}
+
+// --- FINGERPRINT KERNELS ---
+// fingerprint_kernel() is the single body for rolling + winnowing. Each
+// DEFINE_FP_KERNEL(n, w) stamps out a copy with n and w as literal constants,
+// so the compiler unrolls the n-word warm-up and folds the deque's modulo
+// arithmetic; the hash family is fixed per build by HASH_M61. Any other (n, w)
+// goes through the generic copy.
+
+#define KERNEL_MAX_W 16 // windows up to this size keep their deque on the stack
+
+typedef int (*FingerprintKernel)(Arena *arena, const Lexicon *lex, const uint32_t *ids, int wc, const Fingerprint *pow,
+                                 Fingerprint *hashes, WinnowedFingerprint *win, int *numWin);
+
+// Writes every shingle hash to hashes and, when win is non-NULL, the winnowed
+// fingerprints to win. Either output may be NULL. Returns the shingle count.
+static inline __attribute__((always_inline))
+int fingerprint_kernel(Arena *arena, const Lexicon *lex, const uint32_t *ids, int wc, const Fingerprint *pow, int n, int w,
+                       Fingerprint *hashes, WinnowedFingerprint *win, int *numWin) {
+    int count = wc - n + 1;
+    WinnowedFingerprint stackRing[KERNEL_MAX_W];
+    Winnower wn = {w, stackRing, 0, 0, 0, -1, arena};
+    if (win && w > KERNEL_MAX_W) wn.ring = mem_alloc(arena, sizeof(WinnowedFingerprint) * w);
+    int selected = 0;
+
+    RollingHash rh;
+    rolling_init(&rh, pow);
+    for (int i = 0; i < n; i++) rolling_push_word(&rh, lex->hash[ids[i]], lex->words[ids[i]].length);
+    for (int i = 0; i < count; i++) {
+        if (i > 0) {
+            uint32_t out = ids[i-1], in = ids[i+n-1];
+            rolling_pop_word(&rh, lex->hash[out], lex->words[out].length);
+            rolling_push_word(&rh, lex->hash[in], lex->words[in].length);
+        }
+        if (hashes) hashes[i] = rh.h;
+        if (win && winnower_push(&wn, rh.h, i, &win[selected])) selected++;
+    }
+
+    if (wn.ring != stackRing) mem_free(arena, wn.ring);
+    if (numWin) *numWin = selected;
+    return count;
+}
+
+#define DEFINE_FP_KERNEL(N, W) \
+    int fingerprint_kernel_##N##x##W(Arena *arena, const Lexicon *lex, const uint32_t *ids, int wc, \
+                                     const Fingerprint *pow, Fingerprint *hashes, WinnowedFingerprint *win, \
+                                     int *numWin) { \
+        return fingerprint_kernel(arena, lex, ids, wc, pow, N, W, hashes, win, numWin); \
+    }
+
+DEFINE_FP_KERNEL(3, 3)
+DEFINE_FP_KERNEL(4, 4)
+DEFINE_FP_KERNEL(5, 5)
+DEFINE_FP_KERNEL(8, 8)
+
+typedef struct {
+    int n;
+    int w;
+    FingerprintKernel fn;
+} KernelEntry;
+
+static const KernelEntry fp_kernels[] = {
+    {3, 3, fingerprint_kernel_3x3},
+    {4, 4, fingerprint_kernel_4x4},
+    {5, 5, fingerprint_kernel_5x5},
+    {8, 8, fingerprint_kernel_8x8},
+};
+
+int fingerprint_kernel_generic(Arena *arena, const Lexicon *lex, const uint32_t *ids, int wc, const Fingerprint *pow,
+                               int n, int w, Fingerprint *hashes, WinnowedFingerprint *win, int *numWin) {
+    return fingerprint_kernel(arena, lex, ids, wc, pow, n, w, hashes, win, numWin);
+}
+
+// Specialized kernel for (n, w), or NULL. Without winnowing any w will do.
+FingerprintKernel select_fp_kernel(int n, int w, bool winnowing) {
+    for (size_t k = 0; k < sizeof(fp_kernels) / sizeof(fp_kernels[0]); k++) {
+        if (fp_kernels[k].n == n && (!winnowing || fp_kernels[k].w == w)) return fp_kernels[k].fn;
+    }
+    return NULL;
+}
+
+// Rolling hashes of every n-word shingle of tl (into hashes, if non-NULL) and
+// their winnowed fingerprints (into win, if non-NULL; count in *numWin).
+// Scratch comes from the token list's arena. Returns the number of shingles.
+int fingerprint_tokens(const TokenList *tl, int n, int w, Fingerprint *hashes,
+                       WinnowedFingerprint *win, int *numWin) {
+    if (numWin) *numWin = 0;
+    int wc = tl->count;
+    if (n <= 0 || wc < n || (win && w <= 0)) return 0;
+    Fingerprint *pow = create_power_table(tl->arena, n * (tl->lex->maxLen + 1));
+
+    FingerprintKernel kernel = select_fp_kernel(n, w, win != NULL);
+    int count = kernel ? kernel(tl->arena, tl->lex, tl->ids, wc, pow, hashes, win, numWin)
+                       : fingerprint_kernel_generic(tl->arena, tl->lex, tl->ids, wc, pow, n, w, hashes, win, numWin);
+
+#if VERIFY_ROLLING
+    for (int i = 0; hashes && i < count; i++) {
+        if (!fp_equal(hashes[i], get_double_hash(tl, i, n))) {
+            fprintf(stderr, "Rolling hash mismatch at shingle %d\n", i);
+            abort();
+        }
+    }
+#endif
+    mem_free(tl->arena, pow);
+    return count;
+}
+
+// Fills out[i] with the hash of the shingle starting at token i. Each character
+// is hashed once; returns the number of shingles.
+int rolling_hashes(const TokenList *tl, int n, Fingerprint *out) {
+    return fingerprint_tokens(tl, n, 0, out, NULL, NULL);
+}
+
+// --- MULTI-RESOLUTION FINGERPRINTING ---
+// One pass over the tokens drives a rolling hash (and a winnower) per n, so
+// scoring at several n-gram sizes shares preprocessing, tokenization and the
+// token reads instead of repeating the whole pipeline per n.
+
+// Fills res[r].hashes / res[r].win for each res[r].n. keepHashes and winnowing
+// select which outputs are produced; release them with free_resolutions().
+void fingerprint_multi(Arena *arena, const TokenList *tl, Resolution *res, int numRes, int w,
+                       bool keepHashes, bool winnowing) {
+    const Lexicon *lex = tl->lex;
+    int wc = tl->count, maxN = 0;
+    RollingHash rh[MAX_RESOLUTIONS];
+    Winnower wn[MAX_RESOLUTIONS];
+    for (int r = 0; r < numRes; r++) if (res[r].n > maxN) maxN = res[r].n;
+    Fingerprint *pow = create_power_table(arena, maxN * (lex->maxLen + 1));
+
+    for (int r = 0; r < numRes; r++) {
+        int count = wc - res[r].n + 1;
+        if (count < 0) count = 0;
+        res[r].hashes = keepHashes ? mem_alloc(arena, sizeof(Fingerprint) * (count + 1)) : NULL;
+        res[r].win = winnowing ? mem_alloc(arena, sizeof(WinnowedFingerprint) * (count + 1)) : NULL;
+        res[r].numHashes = 0;
+        res[r].numWin = 0;
+        rolling_init(&rh[r], pow);
+        if (winnowing) winnower_init(arena, &wn[r], w);
+    }
+
+    for (int i = 0; i < wc; i++) {
+        Fingerprint inHash = lex->hash[tl->ids[i]];
+        int inLen = lex->words[tl->ids[i]].length;
+        for (int r = 0; r < numRes; r++) {
+            int n = res[r].n;
+            if (i >= n) {
+                uint32_t out = tl->ids[i - n];
+                rolling_pop_word(&rh[r], lex->hash[out], lex->words[out].length);
+            }
+            rolling_push_word(&rh[r], inHash, inLen);
+            if (i < n - 1) continue;
+
+            int pos = i - n + 1;
+            if (keepHashes) res[r].hashes[pos] = rh[r].h;
+            if (winnowing && winnower_push(&wn[r], rh[r].h, pos, &res[r].win[res[r].numWin])) res[r].numWin++;
+            res[r].numHashes = pos + 1;
+        }
+    }
+
+    if (winnowing) for (int r = 0; r < numRes; r++) winnower_free(&wn[r]);
+    mem_free(arena, pow);
+}
+
+void free_resolutions(Arena *arena, Resolution *res, int numRes) {
+    for (int r = 0; r < numRes; r++) {
+        mem_free(arena, res[r].hashes);
+        mem_free(arena, res[r].win);
+        res[r].hashes = NULL;
+        res[r].win = NULL;
+    }
+}
+
+// Verbatim score of B against A for every n in ns, using one token pass per
+// document: matches of B's shingles in A's winnowed set / size of that set.
+void multi_resolution_scores(Arena *arena, const TokenList *tokA, const TokenList *tokB, const int *ns,
+                             int numRes, int w, double *scores) {
+    Resolution resA[MAX_RESOLUTIONS], resB[MAX_RESOLUTIONS];
+    for (int r = 0; r < numRes; r++) { resA[r].n = ns[r]; resB[r].n = ns[r]; }
+    fingerprint_multi(arena, tokA, resA, numRes, w, false, true);
+    fingerprint_multi(arena, tokB, resB, numRes, w, true, false);
+
+    for (int r = 0; r < numRes; r++) {
+        FingerprintSet *fps = create_set(arena);
+        for (int i = 0; i < resA[r].numWin; i++) set_insert(fps, resA[r].win[i].fp);
+        int matches = 0;
+        for (int i = 0; i < resB[r].numHashes; i++) if (set_contains(fps, resB[r].hashes[i])) matches++;
+        scores[r] = fps->size ? (double)matches / fps->size * 100.0 : 0.0;
+        free_set(fps);
+    }
+    free_resolutions(arena, resA, numRes);
+    free_resolutions(arena, resB, numRes);
+}
+
+// --- SORTED MERGE-JOIN ---
+// Alternative to hashing for a one-off document pair: both sides become
+// sorted arrays of fp_key() values and are intersected by a merge, or by
+// galloping search when one side is much smaller. Keys are exact, so no
+// filter is needed in front. fp_key() values stay below 2^62, which lets the
+// AVX2 merge use signed 64-bit compares.
+
+#define GALLOP_RATIO 32 // size ratio past which galloping beats a linear merge
+
+// LSD radix sort of keys (and vals alongside, if not NULL), 8 bits per pass.
+// Passes where every key has the same byte are skipped, e.g. the always-zero
+// top bits of the dual family's two 30-bit halves.
+void radix_sort(Arena *arena, uint64_t *keys, uint32_t *vals, int n) {
+    if (n < 2) return;
+    size_t (*hist)[256] = mem_calloc(arena, sizeof(size_t) * 8 * 256);
+    for (int i = 0; i < n; i++) {
+        for (int b = 0; b < 8; b++) hist[b][(keys[i] >> (8 * b)) & 0xFF]++;
+    }
+    uint64_t *srcK = keys, *dstK = mem_alloc(arena, sizeof(uint64_t) * n), *tmpK = dstK;
+    uint32_t *srcV = vals, *dstV = vals ? mem_alloc(arena, sizeof(uint32_t) * n) : NULL, *tmpV = dstV;
+    for (int b = 0; b < 8; b++) {
+        size_t *h = hist[b];
+        if (h[(srcK[0] >> (8 * b)) & 0xFF] == (size_t)n) continue;
+        size_t sum = 0;
+        for (int d = 0; d < 256; d++) {
+            size_t c = h[d];
+            h[d] = sum;
+            sum += c;
+        }
+        for (int i = 0; i < n; i++) {
+            size_t dst = h[(srcK[i] >> (8 * b)) & 0xFF]++;
+            dstK[dst] = srcK[i];
+            if (vals) dstV[dst] = srcV[i];
+        }
+        uint64_t *k = srcK; srcK = dstK; dstK = k;
+        uint32_t *v = srcV; srcV = dstV; dstV = v;
+    }
+    if (srcK != keys) {
+        memcpy(keys, srcK, sizeof(uint64_t) * n);
+        if (vals) memcpy(vals, srcV, sizeof(uint32_t) * n);
+    }
+    mem_free(arena, hist); mem_free(arena, tmpK); mem_free(arena, tmpV);
+}
+
+// Sorted, distinct keys of the winnowed fingerprints; returns how many.
+int sorted_keys(Arena *arena, const WinnowedFingerprint *win, int count, uint64_t *out) {
+    for (int i = 0; i < count; i++) out[i] = fp_key(win[i].fp);
+    radix_sort(arena, out, NULL, count);
+    int unique = 0;
+    for (int i = 0; i < count; i++) {
+        if (unique == 0 || out[unique - 1] != out[i]) out[unique++] = out[i];
+    }
+    return unique;
+}
+
+// First index >= lo with x[index] >= key (n if none): doubling steps, then
+// binary search inside the last step.
+static int gallop_lower(const uint64_t *x, int lo, int n, uint64_t key) {
+    if (lo >= n || x[lo] >= key) return lo;
+    int step = 1;
+    while (lo + step < n && x[lo + step] < key) {
+        lo += step;
+        step *= 2;
+    }
+    int hi = lo + step < n ? lo + step : n;     // x[lo] < key <= x[hi]
+    while (hi - lo > 1) {
+        int mid = lo + (hi - lo) / 2;
+        if (x[mid] < key) lo = mid; else hi = mid;
+    }
+    return hi;
+}
+
+// The intersection kernels below take distinct keys a and sorted keys b
+// (duplicates allowed) and write the index of every b key present in a to
+// out; they return how many.
+typedef int (*IntersectKernel)(const uint64_t *a, int na, const uint64_t *b, int nb, int *out);
+
+static int merge_from(const uint64_t *a, int na, const uint64_t *b, int nb, int i, int j, int *out, int m) {
+    while (i < na && j < nb) {
+        if (b[j] < a[i]) j++;
+        else if (b[j] > a[i]) i++;
+        else out[m++] = j++;
+    }
+    return m;
+}
+
+int intersect_merge_scalar(const uint64_t *a, int na, const uint64_t *b, int nb, int *out) {
+    return merge_from(a, na, b, nb, 0, 0, out, 0);
+}
+
+#ifdef HAVE_X86_SIMD
+// Compares a[i] against four b keys at once; the keys below a[i] form a
+// prefix of the block, so its popcount is how far b can skip.
+__attribute__((target("avx2,popcnt")))
+int intersect_merge_avx2(const uint64_t *a, int na, const uint64_t *b, int nb, int *out) {
+    int i = 0, j = 0, m = 0;
+    while (i < na && j + 4 <= nb) {
+        __m256i va = _mm256_set1_epi64x((long long)a[i]);
+        __m256i vb = _mm256_loadu_si256((const __m256i *)(b + j));
+        int below = _mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpgt_epi64(va, vb)));
+        j += __builtin_popcount(below);
+        if (below == 0xF) continue;
+        if (b[j] == a[i]) out[m++] = j++;
+        else i++;
+    }
+    return merge_from(a, na, b, nb, i, j, out, m);
+}
+#endif
+
+int intersect_gallop(const uint64_t *a, int na, const uint64_t *b, int nb, int *out) {
+    int m = 0;
+    if (na <= nb) {
+        for (int i = 0, j = 0; i < na && j < nb; i++) {
+            j = gallop_lower(b, j, nb, a[i]);
+            while (j < nb && b[j] == a[i]) out[m++] = j++;
+        }
+    } else {
+        for (int i = 0, j = 0; j < nb && i < na; j++) {
+            i = gallop_lower(a, i, na, b[j]);
+            if (i < na && a[i] == b[j]) out[m++] = j;
+        }
+    }
+    return m;
+}
+
+IntersectKernel select_intersect_kernel(void) {
+#ifdef HAVE_X86_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("popcnt")) return intersect_merge_avx2;
+#endif
+    return intersect_merge_scalar;
+}
+
+// Indices of the b keys found in a (see IntersectKernel); gallops when one
+// side is more than GALLOP_RATIO times the other.
+int intersect_sorted(const uint64_t *a, int na, const uint64_t *b, int nb, int *out) {
+    static IntersectKernel merge = NULL;
+    if (!merge) merge = select_intersect_kernel();
+    if ((long long)na * GALLOP_RATIO < nb || (long long)nb * GALLOP_RATIO < na) {
+        return intersect_gallop(a, na, b, nb, out);
+    }
+    return merge(a, na, b, nb, out);
+}
+
+// --- SUSPECT SCAN ---
+// The hot loop only records (fingerprint, first position) per match; no text
+// is touched. Phrases are rebuilt afterwards, and only for the entries that
+// survive ranking (print_top_phrases).
+
+// Probes every shingle hash of the suspect (tokens tl, n-grams) against the
+// reference set and tallies matches in tally; returns the number of matches.
+int scan_suspect(const Fingerprint *hashes, int count, const TokenList *tl, int n,
+                 const Gatekeeper *gate, FingerprintSet *ref, PhraseTally *tally) {
+    int matches = 0;
+    for (int i = 0; i < count; i++) {
+        Fingerprint f = hashes[i];
+        if (gate_check(gate, f) && set_contains(ref, f)) {
+            matches++;
+            tally_update(tally, f, i, shingle_length(tl, i, n));
+        }
+    }
+    return matches;
+}
+
+// Merge-join counterpart of scan_suspect against sorted, distinct reference
+// keys. The join finds matches grouped by fingerprint, the worst arrival
+// order for the Space-Saving sketch, so they are marked by position and
+// replayed in suspect order: the tally sees the same stream as with hashing.
+int merge_scan_suspect(Arena *arena, const Fingerprint *hashes, int count, const TokenList *tl, int n,
+                       const uint64_t *ref, int numRef, PhraseTally *tally) {
+    uint64_t *keys = mem_alloc(arena, sizeof(uint64_t) * (count + 1));
+    uint32_t *pos = mem_alloc(arena, sizeof(uint32_t) * (count + 1));
+    int *hit = mem_alloc(arena, sizeof(int) * (count + 1));
+    uint8_t *matched = mem_calloc(arena, count + 1);
+    for (int i = 0; i < count; i++) {
+        keys[i] = fp_key(hashes[i]);
+        pos[i] = (uint32_t)i;
+    }
+    radix_sort(arena, keys, pos, count);
+    int matches = intersect_sorted(ref, numRef, keys, count, hit);
+    for (int m = 0; m < matches; m++) matched[pos[hit[m]]] = 1;
+    for (int i = 0; i < count; i++) {
+        if (matched[i]) tally_update(tally, hashes[i], i, shingle_length(tl, i, n));
+    }
+    mem_free(arena, keys); mem_free(arena, pos); mem_free(arena, hit); mem_free(arena, matched);
+    return matches;
+}
+
+// Prints ranked entries (best first), materializing each phrase from its
+// first position.
+void print_top_phrases(const FreqEntry *top, int count, const TokenList *tl, int n) {
+    printf("\nTOP %d MOST FREQUENT PLAGIARIZED PHRASES:\n", count);
+    printf("--------------------------------------------------\n");
+    for (int i = 0; i < count; i++) {
+        char phrase[MAX_PHRASE_LEN];
+        shingle_text(tl, top[i].firstPos, n, phrase, sizeof(phrase));
+        printf("[%d] Freq: %d | Phrase: \"%s\"\n", i + 1, top[i].frequency, phrase);
+    }
+}
+
+// --- INVERTED INDEX ---
+// Many-document counterpart of the A/B scan: every reference document is
+// fingerprinted once, and a suspect is scored against all of them in a single
+// pass over its shingle hashes. Per document the score is the same quantity
+// as the pairwise Verbatim Score.
+
+InvertedIndex* create_index(void) {
+    InvertedIndex *idx = calloc(1, sizeof(InvertedIndex));
+    idx->terms = create_table(NULL, sizeof(uint32_t), 0);
+    idx->postingCap = 1024;
+    idx->postings = malloc(sizeof(Posting) * idx->postingCap);
+    idx->postingTerm = malloc(sizeof(uint32_t) * idx->postingCap);
+    idx->docCap = 16;
+    idx->names = malloc(sizeof(char *) * idx->docCap);
+    idx->docFingerprints = malloc(sizeof(int) * idx->docCap);
+    return idx;
+}
+
+void free_index(InvertedIndex *idx) {
+    if (!idx) return;
+    if (idx->map) {
+        munmap(idx->map, idx->mapSize);
+        free(idx->terms); free(idx->filter); free(idx);
+        return;
+    }
+    free_bloom(idx->filter);
+    for (int d = 0; d < idx->numDocs; d++) free(idx->names[d]);
+    free(idx->names); free(idx->docFingerprints);
+    free(idx->postings); free(idx->postingTerm); free(idx->termStart);
+    free_table(idx->terms);
+    free(idx);
+}
+
+const char* index_doc_name(const InvertedIndex *idx, int doc) {
+    return idx->map ? idx->nameChars + idx->nameOffsets[doc] : idx->names[doc];
+}
+
+// Registers a document with its distinct fingerprint count; returns its doc
+// id. Its postings follow through index_add_posting.
+int index_new_document(InvertedIndex *idx, const char *name, int distinctFingerprints) {
+    if (idx->numDocs == idx->docCap) {
+        idx->docCap *= 2;
+        idx->names = realloc(idx->names, sizeof(char *) * idx->docCap);
+        idx->docFingerprints = realloc(idx->docFingerprints, sizeof(int) * idx->docCap);
+    }
+    idx->names[idx->numDocs] = strdup(name);
+    idx->docFingerprints[idx->numDocs] = distinctFingerprints;
+    free_bloom(idx->filter);    // no longer covers every term
+    idx->filter = NULL;
+    return idx->numDocs++;
+}
+
+void index_add_posting(InvertedIndex *idx, Fingerprint f, uint32_t doc, uint32_t pos) {
+    bool inserted;
+    uint32_t *term = table_value(idx->terms, table_insert(idx->terms, f, &inserted));
+    if (inserted) *term = idx->numTerms++;
+    if (idx->numPostings == idx->postingCap) {
+        idx->postingCap *= 2;
+        idx->postings = realloc(idx->postings, sizeof(Posting) * idx->postingCap);
+        idx->postingTerm = realloc(idx->postingTerm, sizeof(uint32_t) * idx->postingCap);
+    }
+    idx->postings[idx->numPostings] = (Posting){doc, pos};
+    idx->postingTerm[idx->numPostings++] = *term;
+}
+
+// Adds a document's winnowed fingerprints under name; returns its doc id, or
+// -1 for an index opened from a file. scratch (may be NULL) holds the
+// per-document distinct count.
+int index_add_document(InvertedIndex *idx, Arena *scratch, const char *name,
+                       const WinnowedFingerprint *win, int numWin) {
+    if (idx->map) return -1;
+    FingerprintSet *distinct = create_set(scratch);
+    for (int i = 0; i < numWin; i++) set_insert(distinct, win[i].fp);
+    int doc = index_new_document(idx, name, (int)distinct->size);
+    free_set(distinct);
+    for (int i = 0; i < numWin; i++) index_add_posting(idx, win[i].fp, (uint32_t)doc, (uint32_t)win[i].pos);
+    return doc;
+}
+
+// Groups the postings by term with a stable counting sort, so each term's
+// list stays in document order. Only needed after documents were added.
+void index_finalize(InvertedIndex *idx) {
+    if (idx->map || (idx->grouped == idx->numPostings && idx->termStart)) return;
+    free(idx->termStart);
+    idx->termStart = calloc(idx->numTerms + 1, sizeof(uint32_t));
+    for (size_t i = 0; i < idx->numPostings; i++) idx->termStart[idx->postingTerm[i] + 1]++;
+    for (uint32_t t = 0; t < idx->numTerms; t++) idx->termStart[t + 1] += idx->termStart[t];
+    uint32_t *fill = malloc(sizeof(uint32_t) * (idx->numTerms + 1));
+    memcpy(fill, idx->termStart, sizeof(uint32_t) * (idx->numTerms + 1));
+    Posting *postings = malloc(sizeof(Posting) * idx->postingCap);
+    uint32_t *postingTerm = malloc(sizeof(uint32_t) * idx->postingCap);
+    for (size_t i = 0; i < idx->numPostings; i++) {
+        uint32_t dst = fill[idx->postingTerm[i]]++;
+        postings[dst] = idx->postings[i];
+        postingTerm[dst] = idx->postingTerm[i];
+    }
+    free(fill);
+    free(idx->postings); free(idx->postingTerm);
+    idx->postings = postings;
+    idx->postingTerm = postingTerm;
+    idx->grouped = idx->numPostings;
+}
+
+static int doc_hit_compare(const void *a, const void *b) {
+    const DocHit *x = a, *y = b;
+    if (x->score != y->score) return x->score > y->score ? -1 : 1;
+    if (x->matches != y->matches) return x->matches > y->matches ? -1 : 1;
+    return x->doc - y->doc;
+}
+
+static int index_collect(const InvertedIndex *idx, const uint8_t *dead, const Fingerprint *hashes,
+                         const int *pos, int count, int *slot, DocHit *hits);
+
+// Scores every reference document against the suspect's shingle hashes in
+// one pass and writes the best k (room for k) to out, best first; returns
+// how many. A shingle counts at most once per document, as in scan_suspect.
+// Documents with their bit set in dead (may be NULL) are skipped.
+int index_query(InvertedIndex *idx, const uint8_t *dead, const Fingerprint *hashes, int count, int k, DocHit *out) {
+    index_finalize(idx);
+    int *slot = malloc(sizeof(int) * (idx->numDocs + 1));   // doc -> hit index, -1 if untouched
+    for (int d = 0; d < idx->numDocs; d++) slot[d] = -1;
+    DocHit *hits = malloc(sizeof(DocHit) * (idx->numDocs + 1));
+    int numHits = index_collect(idx, dead, hashes, NULL, count, slot, hits);
+    for (int h = 0; h < numHits; h++) {
+        hits[h].name = index_doc_name(idx, hits[h].doc);
+        int fps = idx->docFingerprints[hits[h].doc];
+        hits[h].score = fps ? (double)hits[h].matches / fps * 100.0 : 0.0;
+    }
+    qsort(hits, numHits, sizeof(DocHit), doc_hit_compare);
+    if (numHits > k) numHits = k;
+    memcpy(out, hits, sizeof(DocHit) * numHits);
+    free(hits); free(slot);
+    return numHits;
+}
+
+// Match counting behind index_query: records one unscored hit per document
+// the suspect hashes touch, in first-touch order; returns how many. pos[i] is
+// hashes[i]'s position in the suspect (NULL: i itself) and must ascend. slot
+// must be -1 for every document on entry and is restored on return.
+static int index_collect(const InvertedIndex *idx, const uint8_t *dead, const Fingerprint *hashes,
+                         const int *pos, int count, int *slot, DocHit *hits) {
+    int numHits = 0;
+    for (int i = 0; i < count; i++) {
+        if (idx->filter && !bloom_check(idx->filter, hashes[i])) continue;
+        long t = table_find(idx->terms, hashes[i]);
+        if (t < 0) continue;
+        uint32_t term = *(uint32_t *)table_value(idx->terms, t);
+        uint32_t lastDoc = UINT32_MAX;
+        for (uint32_t p = idx->termStart[term]; p < idx->termStart[term + 1]; p++) {
+            const Posting *post = &idx->postings[p];
+            if (post->doc == lastDoc) continue;
+            lastDoc = post->doc;
+            if (dead && (dead[post->doc >> 3] >> (post->doc & 7) & 1)) continue;
+            if (slot[post->doc] < 0) {
+                slot[post->doc] = numHits;
+                hits[numHits++] = (DocHit){(int)post->doc, NULL, 0, 0.0, pos ? pos[i] : i, (int)post->pos};
+            }
+            hits[slot[post->doc]].matches++;
+        }
+    }
+    for (int h = 0; h < numHits; h++) slot[hits[h].doc] = -1;
+    return numHits;
+}
+
+// Prints ranked documents (best first) with the suspect phrase of each one's
+// first match.
+void print_doc_hits(const DocHit *hits, int count, const TokenList *tl, int n) {
+    printf("\nTOP %d REFERENCE DOCUMENTS:\n", count);
+    printf("--------------------------------------------------\n");
+    for (int h = 0; h < count; h++) {
+        char phrase[MAX_PHRASE_LEN];
+        shingle_text(tl, hits[h].firstSuspectPos, n, phrase, sizeof(phrase));
+        printf("[%d] %s | Matches: %d | Verbatim Score: %.1f%% | First shared phrase: \"%s\"\n",
+               h + 1, hits[h].name, hits[h].matches, hits[h].score, phrase);
+    }
+}
+
+// Builds the optional Bloom gate over every term of the index.
+void index_build_filter(InvertedIndex *idx) {
+    if (idx->map) return;
+    free_bloom(idx->filter);
+    idx->filter = create_bloom(NULL, idx->numTerms, BLOOM_FPR);
+    for (size_t i = 0; i < idx->terms->capacity; i++) {
+        if (table_slot_used(idx->terms, i)) bloom_add(idx->filter, idx->terms->keys[i]);
+    }
+}
+
+// --- INDEX FILES ---
+// A saved index is opened with mmap and queried in place: opening costs the
+// same for ten documents or a million, and concurrent processes share the
+// pages through the OS cache. Files are tied to the build's hash family and
+// byte order, and record the n and w their fingerprints were taken with.
+
+// Appends bytes at the next 64-byte boundary; returns their offset.
+static uint64_t write_section(FILE *f, const void *data, size_t bytes) {
+    static const char zeros[64] = {0};
+    long pos = ftell(f);
+    fwrite(zeros, 1, (size_t)((64 - pos % 64) % 64), f);
+    uint64_t off = (uint64_t)ftell(f);
+    if (bytes) fwrite(data, 1, bytes, f);
+    return off;
+}
+
+// Writes the index (finalizing it first) for open_index; false on I/O error.
+// The file is written next to path and renamed over it, so processes that
+// have the old file mapped keep reading the old file.
+bool index_save(InvertedIndex *idx, const char *path, int n, int w) {
+    if (idx->map) return false;
+    index_finalize(idx);
+    char tmp[4096];
+    if (snprintf(tmp, sizeof(tmp), "%s.tmp", path) >= (int)sizeof(tmp)) return false;
+    FILE *f = fopen(tmp, "wb");
+    if (!f) return false;
+
+    IndexHeader hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, INDEX_MAGIC, sizeof(hdr.magic));
+    hdr.version = INDEX_VERSION;
+    hdr.endianTag = 0x01020304;
+    hdr.hashM61 = HASH_M61;
+    hdr.fingerprintSize = sizeof(Fingerprint);
+    hdr.n = (uint32_t)n;
+    hdr.w = (uint32_t)w;
+    hdr.numDocs = (uint32_t)idx->numDocs;
+    hdr.numTerms = idx->numTerms;
+    hdr.numPostings = idx->numPostings;
+    hdr.tableCapacity = idx->terms->capacity;
+    fwrite(&hdr, sizeof(hdr), 1, f);
+
+    const FpTable *t = idx->terms;
+    hdr.ctrlOff = write_section(f, t->ctrl, t->capacity);
+    hdr.keysOff = write_section(f, t->keys, sizeof(Fingerprint) * t->capacity);
+    hdr.valsOff = write_section(f, t->vals, t->valSize * t->capacity);
+    hdr.termStartOff = write_section(f, idx->termStart, sizeof(uint32_t) * (idx->numTerms + 1));
+    hdr.postingsOff = write_section(f, idx->postings, sizeof(Posting) * idx->numPostings);
+    hdr.docFingerprintsOff = write_section(f, idx->docFingerprints, sizeof(int) * idx->numDocs);
+
+    uint32_t *nameOffsets = malloc(sizeof(uint32_t) * (idx->numDocs + 1));
+    nameOffsets[0] = 0;
+    for (int d = 0; d < idx->numDocs; d++) nameOffsets[d + 1] = nameOffsets[d] + (uint32_t)strlen(idx->names[d]) + 1;
+    hdr.nameOffsetsOff = write_section(f, nameOffsets, sizeof(uint32_t) * (idx->numDocs + 1));
+    hdr.nameCharsOff = write_section(f, NULL, 0);
+    for (int d = 0; d < idx->numDocs; d++) fwrite(idx->names[d], 1, strlen(idx->names[d]) + 1, f);
+    free(nameOffsets);
+
+    if (idx->filter) {
+        hdr.bloomK = (uint32_t)idx->filter->k;
+        hdr.bloomBlocks = idx->filter->numBlocks;
+        hdr.bloomOff = write_section(f, idx->filter->blocks, (size_t)idx->filter->numBlocks * 64);
+    }
+    hdr.fileSize = write_section(f, NULL, 0);
+
+    fseek(f, 0, SEEK_SET);
+    fwrite(&hdr, sizeof(hdr), 1, f);
+    bool ok = fflush(f) == 0 && !ferror(f) && fsync(fileno(f)) == 0;
+    ok = fclose(f) == 0 && ok && rename(tmp, path) == 0;
+    if (!ok) unlink(tmp);
+    return ok;
+}
+
+// True if count items of size bytes at off lie inside the file, with off on
+// a section boundary.
+static bool section_ok(uint64_t off, uint64_t count, size_t size, uint64_t fileSize) {
+    return off % 64 == 0 && off >= sizeof(IndexHeader) && off <= fileSize
+        && count <= (fileSize - off) / size;
+}
+
+// Why a mapped file is not a usable index, or NULL. The section checks are
+// O(1); the name and term directories, the fingerprint table and the
+// postings get one sequential pass each, so no value read from the file can
+// index past the map or the query scratch, and every probe of the table ends.
+static const char* index_file_error(const IndexHeader *hdr, const char *base, uint64_t fileSize) {
+    if (memcmp(hdr->magic, INDEX_MAGIC, sizeof(hdr->magic)) != 0) return "not an index file";
+    if (hdr->version != INDEX_VERSION) return "unsupported index version";
+    if (hdr->endianTag != 0x01020304) return "written with another byte order";
+    if (hdr->hashM61 != HASH_M61 || hdr->fingerprintSize != sizeof(Fingerprint)) return "built with another hash family";
+    if (hdr->fileSize != fileSize) return "truncated or extended";
+    if (hdr->tableCapacity < GROUP_WIDTH || (hdr->tableCapacity & (hdr->tableCapacity - 1))
+        || hdr->numTerms > hdr->tableCapacity) return "bad fingerprint table size";
+    if (hdr->numDocs > INT32_MAX) return "too many documents";
+    if (!section_ok(hdr->ctrlOff, hdr->tableCapacity, 1, fileSize)
+        || !section_ok(hdr->keysOff, hdr->tableCapacity, sizeof(Fingerprint), fileSize)
+        || !section_ok(hdr->valsOff, hdr->tableCapacity, sizeof(uint32_t), fileSize)
+        || !section_ok(hdr->termStartOff, (uint64_t)hdr->numTerms + 1, sizeof(uint32_t), fileSize)
+        || !section_ok(hdr->postingsOff, hdr->numPostings, sizeof(Posting), fileSize)
+        || !section_ok(hdr->docFingerprintsOff, hdr->numDocs, sizeof(int), fileSize)
+        || !section_ok(hdr->nameOffsetsOff, (uint64_t)hdr->numDocs + 1, sizeof(uint32_t), fileSize)
+        || (hdr->bloomBlocks && !section_ok(hdr->bloomOff, hdr->bloomBlocks, 64, fileSize))) {
+        return "section outside the file";
+    }
+    if (hdr->bloomBlocks && (hdr->bloomK < 1 || hdr->bloomK > 16)) return "bad filter parameters";
+    const uint32_t *nameOffsets = (const uint32_t *)(base + hdr->nameOffsetsOff);
+    uint32_t nameBytes = nameOffsets[hdr->numDocs];
+    if (nameOffsets[0] != 0 || !section_ok(hdr->nameCharsOff, nameBytes, 1, fileSize)
+        || (nameBytes && base[hdr->nameCharsOff + nameBytes - 1] != '\0')) {
+        return "bad document names";
+    }
+    for (uint32_t d = 0; d < hdr->numDocs; d++) {
+        if (nameOffsets[d] > nameOffsets[d + 1]) return "bad document names";
+    }
+    const uint32_t *termStart = (const uint32_t *)(base + hdr->termStartOff);
+    if (termStart[0] != 0 || termStart[hdr->numTerms] != hdr->numPostings) return "bad posting directory";
+    for (uint32_t t = 0; t < hdr->numTerms; t++) {
+        if (termStart[t] > termStart[t + 1]) return "bad posting directory";
+    }
+    const unsigned char *ctrl = (const unsigned char *)(base + hdr->ctrlOff);
+    const uint32_t *vals = (const uint32_t *)(base + hdr->valsOff);
+    uint64_t used = 0;
+    bool empty = false;
+    for (uint64_t slot = 0; slot < hdr->tableCapacity; slot++) {
+        if (ctrl[slot] == CTRL_EMPTY) {
+            empty = true;
+        } else if (ctrl[slot] < 0x80) {
+            if (vals[slot] >= hdr->numTerms) return "bad fingerprint table";
+            used++;
+        } else if (ctrl[slot] != CTRL_DELETED) {
+            return "bad fingerprint table";
+        }
+    }
+    if (!empty || used != hdr->numTerms) return "bad fingerprint table";
+    const Posting *postings = (const Posting *)(base + hdr->postingsOff);
+    for (uint64_t p = 0; p < hdr->numPostings; p++) {
+        if (postings[p].doc >= hdr->numDocs) return "bad postings";
+    }
+    return NULL;
+}
+
+// Maps an index file read-only and points an InvertedIndex into it. NULL if
+// the file is missing, truncated, corrupt, from another version, or was
+// built with a different hash family or byte order; the reason is printed.
+// n and w receive the build parameters.
+InvertedIndex* open_index(const char *path, int *n, int *w) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return NULL;
+    struct stat st;
+    void *map = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && (size_t)st.st_size >= sizeof(IndexHeader)) {
+        map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    }
+    close(fd);
+    if (map == MAP_FAILED) return NULL;
+
+    const IndexHeader *hdr = map;
+    char *base = map;
+    const char *why = index_file_error(hdr, base, (uint64_t)st.st_size);
+    if (why) {
+        printf("Error: %s: %s\n", path, why);
+        munmap(map, (size_t)st.st_size);
+        return NULL;
+    }
+
+    InvertedIndex *idx = calloc(1, sizeof(InvertedIndex));
+    idx->map = map;
+    idx->mapSize = (size_t)st.st_size;
+    idx->terms = calloc(1, sizeof(FpTable));
+    idx->terms->ctrl = (unsigned char *)(base + hdr->ctrlOff);
+    idx->terms->keys = (Fingerprint *)(base + hdr->keysOff);
+    idx->terms->vals = (unsigned char *)(base + hdr->valsOff);
+    idx->terms->valSize = sizeof(uint32_t);
+    idx->terms->capacity = hdr->tableCapacity;
+    idx->terms->size = hdr->numTerms;
+    idx->numTerms = hdr->numTerms;
+    idx->termStart = (uint32_t *)(base + hdr->termStartOff);
+    idx->postings = (Posting *)(base + hdr->postingsOff);
+    idx->numPostings = idx->grouped = idx->postingCap = hdr->numPostings;
+    idx->docFingerprints = (int *)(base + hdr->docFingerprintsOff);
+    idx->numDocs = idx->docCap = (int)hdr->numDocs;
+    idx->nameOffsets = (const uint32_t *)(base + hdr->nameOffsetsOff);
+    idx->nameChars = base + hdr->nameCharsOff;
+    if (hdr->bloomBlocks) {
+        idx->filter = calloc(1, sizeof(BloomFilter));
+        idx->filter->blocks = (uint64_t *)(base + hdr->bloomOff);
+        idx->filter->numBlocks = hdr->bloomBlocks;
+        idx->filter->k = (int)hdr->bloomK;
+    }
+    *n = (int)hdr->n;
+    *w = (int)hdr->w;
+    return idx;
+}
+
+// --- SEGMENTED CORPUS ---
+// Incremental maintenance of the reference corpus. Ingest touches only the
+// new documents (plus an O(segments) snapshot copy); a removal copies one
+// segment's tombstone bitmap. Readers pin a snapshot and never block on, or
+// see half of, a commit or compaction. Compaction merges a run of the newest
+// segments (size-tiered, COMPACT_FANOUT) or rewrites tombstone-heavy ones,
+// off the lock, and republishes carrying over removals made meanwhile.
+
+static bool tomb_test(const Tombstones *t, int d) {
+    return t && (t->bits[d >> 3] >> (d & 7) & 1);
+}
+
+static Tombstones* tomb_copy(const Tombstones *t, int numDocs) {
+    size_t bytes = (size_t)(numDocs + 7) / 8;
+    Tombstones *c = calloc(1, sizeof(Tombstones) + bytes);
+    if (t) {
+        memcpy(c->bits, t->bits, bytes);
+        c->count = t->count;
+    }
+    c->refs = 1;
+    return c;
+}
+
+static void tomb_set(Tombstones *t, int d) {
+    if (!tomb_test(t, d)) {
+        t->bits[d >> 3] |= (uint8_t)(1 << (d & 7));
+        t->count++;
+    }
+}
+
+static Segment* create_segment(InvertedIndex *idx, uint32_t *globalIds) {
+    Segment *seg = malloc(sizeof(Segment));
+    index_finalize(idx);
+    index_build_filter(idx);
+    seg->idx = idx;
+    seg->globalIds = globalIds;
+    seg->refs = 1;
+    return seg;
+}
+
+// The release functions below expect the corpus lock (or sole ownership).
+static void segment_release(Segment *seg) {
+    if (--seg->refs > 0) return;
+    free_index(seg->idx);
+    free(seg->globalIds);
+    free(seg);
+}
+
+static void tomb_release(Tombstones *t) {
+    if (t && --t->refs == 0) free(t);
+}
+
+static CorpusSnapshot* snapshot_alloc(int numSegs) {
+    CorpusSnapshot *s = malloc(sizeof(CorpusSnapshot));
+    s->segs = malloc(sizeof(Segment *) * (numSegs + 1));
+    s->dead = calloc(numSegs + 1, sizeof(Tombstones *));
+    s->numSegs = numSegs;
+    s->refs = 1;
+    return s;
+}
+
+static void snapshot_release(CorpusSnapshot *s) {
+    if (--s->refs > 0) return;
+    for (int i = 0; i < s->numSegs; i++) {
+        segment_release(s->segs[i]);
+        tomb_release(s->dead[i]);
+    }
+    free(s->segs); free(s->dead);
+    free(s);
+}
+
+// Copies segs[from, to) of s (with their tombstones) into next at at.
+static void snapshot_share(CorpusSnapshot *next, int at, const CorpusSnapshot *s, int from, int to) {
+    for (int i = from; i < to; i++, at++) {
+        next->segs[at] = s->segs[i];
+        next->segs[at]->refs++;
+        next->dead[at] = s->dead[i];
+        if (next->dead[at]) next->dead[at]->refs++;
+    }
+}
+
+// Swaps in next as the current snapshot. Caller holds the lock.
+static void corpus_publish(Corpus *c, CorpusSnapshot *next) {
+    CorpusSnapshot *old = c->current;
+    c->current = next;
+    snapshot_release(old);
+    c->dirty = true;
+    pthread_cond_signal(&c->wake);
+}
+
+Corpus* create_corpus(void) {
+    Corpus *c = calloc(1, sizeof(Corpus));
+    pthread_mutex_init(&c->lock, NULL);
+    pthread_mutex_init(&c->staging, NULL);
+    pthread_mutex_init(&c->committing, NULL);
+    pthread_mutex_init(&c->compacting, NULL);
+    pthread_cond_init(&c->wake, NULL);
+    c->current = snapshot_alloc(0);
+    c->pending = create_index();
+    return c;
+}
+
+// Pins the current snapshot for a reader; pair with corpus_release.
+CorpusSnapshot* corpus_snapshot(Corpus *c) {
+    pthread_mutex_lock(&c->lock);
+    CorpusSnapshot *s = c->current;
+    s->refs++;
+    pthread_mutex_unlock(&c->lock);
+    return s;
+}
+
+void corpus_release(Corpus *c, CorpusSnapshot *s) {
+    pthread_mutex_lock(&c->lock);
+    snapshot_release(s);
+    pthread_mutex_unlock(&c->lock);
+}
+
+// Stages a document for the next commit; returns its corpus-wide id.
+uint32_t corpus_add_document(Corpus *c, Arena *scratch, const char *name,
+                             const WinnowedFingerprint *win, int numWin) {
+    pthread_mutex_lock(&c->staging);
+    index_add_document(c->pending, scratch, name, win, numWin);
+    uint32_t id = c->nextId++;
+    pthread_mutex_unlock(&c->staging);
+    return id;
+}
+
+// Seals the staged documents into a new segment and publishes it; returns
+// how many documents became visible. The segment is built with only the
+// staged batch detached, so readers and new additions do not wait for it.
+int corpus_commit(Corpus *c) {
+    pthread_mutex_lock(&c->committing);
+    pthread_mutex_lock(&c->staging);
+    InvertedIndex *batch = c->pending;
+    uint32_t base = c->pendingBase;
+    int added = batch->numDocs;
+    if (added > 0) {
+        c->pending = create_index();
+        c->pendingBase = c->nextId;
+    }
+    pthread_mutex_unlock(&c->staging);
+    if (added > 0) {
+        uint32_t *ids = malloc(sizeof(uint32_t) * added);
+        for (int d = 0; d < added; d++) ids[d] = base + (uint32_t)d;
+        Segment *seg = create_segment(batch, ids);
+        pthread_mutex_lock(&c->lock);
+        CorpusSnapshot *cur = c->current, *next = snapshot_alloc(cur->numSegs + 1);
+        snapshot_share(next, 0, cur, 0, cur->numSegs);
+        next->segs[cur->numSegs] = seg;
+        corpus_publish(c, next);
+        pthread_mutex_unlock(&c->lock);
+    }
+    pthread_mutex_unlock(&c->committing);
+    return added;
+}
+
+// Local document of a global id in segment seg, or -1.
+static int segment_find(const Segment *seg, uint32_t id) {
+    int lo = 0, hi = seg->idx->numDocs;
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        if (seg->globalIds[mid] < id) lo = mid + 1; else hi = mid;
+    }
+    return lo < seg->idx->numDocs && seg->globalIds[lo] == id ? lo : -1;
+}
+
+// Tombstones a committed document; false if it is unknown or already gone.
+bool corpus_remove(Corpus *c, uint32_t id) {
+    pthread_mutex_lock(&c->lock);
+    CorpusSnapshot *cur = c->current;
+    bool removed = false;
+    for (int i = 0; i < cur->numSegs && !removed; i++) {
+        int d = segment_find(cur->segs[i], id);
+        if (d < 0 || tomb_test(cur->dead[i], d)) continue;
+        CorpusSnapshot *next = snapshot_alloc(cur->numSegs);
+        snapshot_share(next, 0, cur, 0, cur->numSegs);
+        tomb_release(next->dead[i]);
+        next->dead[i] = tomb_copy(cur->dead[i], cur->segs[i]->idx->numDocs);
+        tomb_set(next->dead[i], d);
+        corpus_publish(c, next);
+        removed = true;
+    }
+    pthread_mutex_unlock(&c->lock);
+    return removed;
+}
+
+// Live documents of s->segs[lo, hi) rewritten as one segment, in order.
+static Segment* merge_segments(const CorpusSnapshot *s, int lo, int hi) {
+    InvertedIndex *out = create_index();
+    int total = 0;
+    for (int i = lo; i < hi; i++) total += s->segs[i]->idx->numDocs;
+    uint32_t *ids = malloc(sizeof(uint32_t) * (total + 1));
+    uint32_t *remap = malloc(sizeof(uint32_t) * (total + 1));
+    int base = 0;
+    for (int i = lo; i < hi; i++) {
+        const InvertedIndex *idx = s->segs[i]->idx;
+        for (int d = 0; d < idx->numDocs; d++) {
+            remap[base + d] = UINT32_MAX;
+            if (tomb_test(s->dead[i], d)) continue;
+            remap[base + d] = (uint32_t)index_new_document(out, index_doc_name(idx, d), idx->docFingerprints[d]);
+            ids[remap[base + d]] = s->segs[i]->globalIds[d];
+        }
+        base += idx->numDocs;
+    }
+    // Segment by segment, so every term's postings stay in document order.
+    base = 0;
+    for (int i = lo; i < hi; i++) {
+        const InvertedIndex *idx = s->segs[i]->idx;
+        for (size_t slot = 0; slot < idx->terms->capacity; slot++) {
+            if (!table_slot_used(idx->terms, slot)) continue;
+            uint32_t term = *(uint32_t *)table_value(idx->terms, slot);
+            for (uint32_t p = idx->termStart[term]; p < idx->termStart[term + 1]; p++) {
+                uint32_t doc = remap[base + idx->postings[p].doc];
+                if (doc != UINT32_MAX) index_add_posting(out, idx->terms->keys[slot], doc, idx->postings[p].pos);
+            }
+        }
+        base += idx->numDocs;
+    }
+    free(remap);
+    return create_segment(out, ids);
+}
+
+// Runs one compaction step (every segment when full); false if there was
+// nothing worth merging.
+bool corpus_compact(Corpus *c, bool full) {
+    pthread_mutex_lock(&c->compacting);
+    CorpusSnapshot *snap = corpus_snapshot(c);
+    int num = snap->numSegs, lo = num > 0 ? num - 1 : 0;
+    if (full) {
+        lo = 0;
+    } else if (num > 0) {
+        size_t tail = snap->segs[num - 1]->idx->numPostings;
+        while (lo > 0 && snap->segs[lo - 1]->idx->numPostings < COMPACT_FANOUT * tail) {
+            tail += snap->segs[--lo]->idx->numPostings;
+        }
+        for (int i = 0; i < lo; i++) {
+            const Tombstones *t = snap->dead[i];
+            if (t && t->count >= COMPACT_DEAD_RATIO * snap->segs[i]->idx->numDocs) { lo = i; break; }
+        }
+    }
+    bool worth = num - lo >= 2 || (num - lo == 1 && snap->dead[lo] && snap->dead[lo]->count > 0);
+    if (!worth) {
+        corpus_release(c, snap);
+        pthread_mutex_unlock(&c->compacting);
+        return false;
+    }
+
+    Segment *merged = merge_segments(snap, lo, num);
+
+    pthread_mutex_lock(&c->lock);
+    // Only commits (appending segments) and removals ran meanwhile, so the
+    // first num segments are still the ones merged.
+    CorpusSnapshot *cur = c->current;
+    CorpusSnapshot *next = snapshot_alloc(lo + 1 + cur->numSegs - num);
+    snapshot_share(next, 0, cur, 0, lo);
+    next->segs[lo] = merged;
+    snapshot_share(next, lo + 1, cur, num, cur->numSegs);
+    for (int i = lo; i < num; i++) {
+        for (int d = 0; d < cur->segs[i]->idx->numDocs; d++) {
+            if (!tomb_test(cur->dead[i], d) || tomb_test(snap->dead[i], d)) continue;
+            if (!next->dead[lo]) next->dead[lo] = tomb_copy(NULL, merged->idx->numDocs);
+            tomb_set(next->dead[lo], segment_find(merged, cur->segs[i]->globalIds[d]));
+        }
+    }
+    corpus_publish(c, next);
+    c->compactions++;
+    snapshot_release(snap);
+    pthread_mutex_unlock(&c->lock);
+    pthread_mutex_unlock(&c->compacting);
+    return true;
+}
+
+static void* compactor_main(void *arg) {
+    Corpus *c = arg;
+    pthread_mutex_lock(&c->lock);
+    while (!c->stop) {
+        if (!c->dirty) {
+            pthread_cond_wait(&c->wake, &c->lock);
+            continue;
+        }
+        c->dirty = false;
+        pthread_mutex_unlock(&c->lock);
+        while (corpus_compact(c, false)) {}
+        pthread_mutex_lock(&c->lock);
+    }
+    pthread_mutex_unlock(&c->lock);
+    return NULL;
+}
+
+// Compacts in a background thread after every commit or removal.
+void corpus_start_compactor(Corpus *c) {
+    if (!c->background) c->background = pthread_create(&c->compactor, NULL, compactor_main, c) == 0;
+}
+
+void free_corpus(Corpus *c) {
+    if (!c) return;
+    if (c->background) {
+        pthread_mutex_lock(&c->lock);
+        c->stop = true;
+        pthread_cond_signal(&c->wake);
+        pthread_mutex_unlock(&c->lock);
+        pthread_join(c->compactor, NULL);
+    }
+    snapshot_release(c->current);
+    free_index(c->pending);
+    pthread_cond_destroy(&c->wake);
+    pthread_mutex_destroy(&c->compacting);
+    pthread_mutex_destroy(&c->committing);
+    pthread_mutex_destroy(&c->staging);
+    pthread_mutex_destroy(&c->lock);
+    free(c);
+}
+
+// index_query over every segment of a snapshot; doc in the hits is the
+// corpus-wide id.
+int corpus_query(const CorpusSnapshot *s, const Fingerprint *hashes, int count, int k, DocHit *out) {
+    DocHit *all = malloc(sizeof(DocHit) * ((size_t)k * s->numSegs + 1));
+    int numAll = 0;
+    for (int i = 0; i < s->numSegs; i++) {
+        int got = index_query(s->segs[i]->idx, s->dead[i] ? s->dead[i]->bits : NULL, hashes, count, k, all + numAll);
+        for (int h = 0; h < got; h++) all[numAll + h].doc = (int)s->segs[i]->globalIds[all[numAll + h].doc];
+        numAll += got;
+    }
+    qsort(all, numAll, sizeof(DocHit), doc_hit_compare);
+    if (numAll > k) numAll = k;
+    memcpy(out, all, sizeof(DocHit) * numAll);
+    free(all);
+    return numAll;
+}
+
+// Splits a query by fingerprint hash prefix so every shard can be probed on
+// its own core. The workers share the index (in memory or mapped), so setting
+// up costs O(shards * docs) for their scratch and nothing per posting. Each
+// query is partitioned once, by a stable counting sort on the shard, and a
+// worker walks only its own part. A suspect shingle lives in exactly one
+// shard, so a document's total is the sum of its per-shard counts: each
+// worker returns its candidates sorted by doc, and a k-way merge over the
+// shards sums them and keeps the top K in a heap. Results equal index_query's.
+
+// Shard of a fingerprint among 2^shardBits.
+static inline int fingerprint_shard(Fingerprint f, int shardBits) {
+    return (int)(mix64(fp_key(f)) >> (64 - shardBits));
+}
+
+static int doc_id_compare(const void *a, const void *b) {
+    return ((const DocHit *)a)->doc - ((const DocHit *)b)->doc;
+}
+
+static void* shard_worker_main(void *arg) {
+    ShardWorker *wk = arg;
+    ShardedIndex *si = wk->si;
+    uint64_t seen = 0;
+    for (;;) {
+        pthread_mutex_lock(&si->lock);
+        while (!si->stop && si->generation == seen) pthread_cond_wait(&si->start, &si->lock);
+        if (si->stop) {
+            pthread_mutex_unlock(&si->lock);
+            return NULL;
+        }
+        seen = si->generation;
+        pthread_mutex_unlock(&si->lock);
+
+        wk->numHits = index_collect(si->docs, NULL, wk->hashes, wk->pos, wk->count, wk->slot, wk->hits);
+        qsort(wk->hits, wk->numHits, sizeof(DocHit), doc_id_compare);
+
+        pthread_mutex_lock(&si->lock);
+        if (--si->pending == 0) pthread_cond_signal(&si->done);
+        pthread_mutex_unlock(&si->lock);
+    }
+}
+
+// Shard count for this machine: online cores rounded down to a power of two.
+int online_cores(void) {
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    return cores < 1 ? 1 : cores > MAX_SHARDS ? MAX_SHARDS : (int)cores;
+}
+
+int default_shard_count(void) {
+    int shards = 1;
+    while (shards * 2 <= online_cores()) shards *= 2;
+    return shards;
+}
+
+// Queries src (which must outlive the result) with numShards shards, rounded
+// down to a power of two, and starts their workers.
+ShardedIndex* create_sharded_index(InvertedIndex *src, int numShards) {
+    index_finalize(src);
+    ShardedIndex *si = calloc(1, sizeof(ShardedIndex));
+    si->docs = src;
+    while ((2 << si->shardBits) <= numShards && (2 << si->shardBits) <= MAX_SHARDS) si->shardBits++;
+    si->numShards = 1 << si->shardBits;
+    if (si->numShards == 1) return si;
+
+    pthread_mutex_init(&si->lock, NULL);
+    pthread_mutex_init(&si->queryLock, NULL);
+    pthread_cond_init(&si->start, NULL);
+    pthread_cond_init(&si->done, NULL);
+    si->workers = calloc(si->numShards, sizeof(ShardWorker));
+    si->threads = malloc(sizeof(pthread_t) * si->numShards);
+    for (int sh = 0; sh < si->numShards; sh++) {
+        ShardWorker *wk = &si->workers[sh];
+        wk->si = si;
+        wk->shard = sh;
+        wk->slot = malloc(sizeof(int) * (src->numDocs + 1));
+        for (int d = 0; d < src->numDocs; d++) wk->slot[d] = -1;
+        wk->hits = malloc(sizeof(DocHit) * (src->numDocs + 1));
+        pthread_create(&si->threads[sh], NULL, shard_worker_main, wk);
+    }
+    return si;
+}
+
+void free_sharded_index(ShardedIndex *si) {
+    if (!si) return;
+    if (si->numShards == 1) {
+        free(si);
+        return;
+    }
+    pthread_mutex_lock(&si->lock);
+    si->stop = true;
+    pthread_cond_broadcast(&si->start);
+    pthread_mutex_unlock(&si->lock);
+    for (int sh = 0; sh < si->numShards; sh++) {
+        pthread_join(si->threads[sh], NULL);
+        free(si->workers[sh].slot);
+        free(si->workers[sh].hits);
+    }
+    pthread_cond_destroy(&si->start);
+    pthread_cond_destroy(&si->done);
+    pthread_mutex_destroy(&si->queryLock);
+    pthread_mutex_destroy(&si->lock);
+    free(si->workers); free(si->threads);
+    free(si->partHashes); free(si->partPos); free(si->partShard);
+    free(si);
+}
+
+// Keeps the k best hits in a heap with the worst at the root.
+static void hit_heap_offer(DocHit *heap, int *size, int k, DocHit h) {
+    int i;
+    if (*size < k) {
+        i = (*size)++;
+        while (i > 0 && doc_hit_compare(&heap[(i - 1) / 2], &h) < 0) {
+            heap[i] = heap[(i - 1) / 2];
+            i = (i - 1) / 2;
+        }
+    } else if (k > 0 && doc_hit_compare(&h, &heap[0]) < 0) {
+        i = 0;
+        for (;;) {
+            int worst = -1, l = 2 * i + 1, r = l + 1;
+            if (l < *size && doc_hit_compare(&heap[l], &h) > 0) worst = l;
+            if (r < *size && doc_hit_compare(&heap[r], worst < 0 ? &h : &heap[l]) > 0) worst = r;
+            if (worst < 0) break;
+            heap[i] = heap[worst];
+            i = worst;
+        }
+    } else {
+        return;
+    }
+    heap[i] = h;
+}
+
+static inline int cursor_doc(const ShardedIndex *si, const int *cursor, int sh) {
+    return si->workers[sh].hits[cursor[sh]].doc;
+}
+
+static void cursor_sift_down(const ShardedIndex *si, const int *cursor, int *order, int live, int j) {
+    for (;;) {
+        int m = j, l = 2 * j + 1, r = l + 1;
+        if (l < live && cursor_doc(si, cursor, order[l]) < cursor_doc(si, cursor, order[m])) m = l;
+        if (r < live && cursor_doc(si, cursor, order[r]) < cursor_doc(si, cursor, order[m])) m = r;
+        if (m == j) return;
+        int t = order[j]; order[j] = order[m]; order[m] = t;
+        j = m;
+    }
+}
+
+// index_query across all shards in parallel; same results.
+int sharded_query(ShardedIndex *si, const Fingerprint *hashes, int count, int k, DocHit *out) {
+    if (si->numShards == 1) return index_query(si->docs, NULL, hashes, count, k, out);
+    pthread_mutex_lock(&si->queryLock);
+    if (count > si->partCap) {
+        si->partCap = count;
+        si->partHashes = realloc(si->partHashes, sizeof(Fingerprint) * count);
+        si->partPos = realloc(si->partPos, sizeof(int) * count);
+        si->partShard = realloc(si->partShard, count);
+    }
+    // Stable counting sort by shard, so each part keeps suspect order.
+    int start[MAX_SHARDS + 1] = {0};
+    for (int i = 0; i < count; i++) {
+        si->partShard[i] = (uint8_t)fingerprint_shard(hashes[i], si->shardBits);
+        start[si->partShard[i] + 1]++;
+    }
+    for (int sh = 0; sh < si->numShards; sh++) start[sh + 1] += start[sh];
+    for (int sh = 0; sh < si->numShards; sh++) {
+        ShardWorker *wk = &si->workers[sh];
+        wk->hashes = si->partHashes + start[sh];
+        wk->pos = si->partPos + start[sh];
+        wk->count = start[sh + 1] - start[sh];
+    }
+    for (int i = 0; i < count; i++) {
+        int at = start[si->partShard[i]]++;
+        si->partHashes[at] = hashes[i];
+        si->partPos[at] = i;
+    }
+
+    pthread_mutex_lock(&si->lock);
+    si->pending = si->numShards;
+    si->generation++;
+    pthread_cond_broadcast(&si->start);
+    while (si->pending > 0) pthread_cond_wait(&si->done, &si->lock);
+    pthread_mutex_unlock(&si->lock);
+
+    // k-way merge by doc: order[] is a min-heap of the shards' cursors.
+    int cursor[MAX_SHARDS], order[MAX_SHARDS], live = 0, size = 0;
+    for (int sh = 0; sh < si->numShards; sh++) {
+        cursor[sh] = 0;
+        if (si->workers[sh].numHits > 0) order[live++] = sh;
+    }
+    for (int i = live / 2 - 1; i >= 0; i--) cursor_sift_down(si, cursor, order, live, i);
+    DocHit acc = {-1, NULL, 0, 0.0, 0, 0};
+    while (live > 0) {
+        int sh = order[0];
+        const DocHit *h = &si->workers[sh].hits[cursor[sh]];
+        if (h->doc != acc.doc) {
+            if (acc.doc >= 0) hit_heap_offer(out, &size, k, acc);
+            acc = *h;
+        } else {
+            acc.matches += h->matches;
+            if (h->firstSuspectPos < acc.firstSuspectPos) {
+                acc.firstSuspectPos = h->firstSuspectPos;
+                acc.firstRefPos = h->firstRefPos;
+            }
+        }
+        int fps = si->docs->docFingerprints[acc.doc];
+        acc.score = fps ? (double)acc.matches / fps * 100.0 : 0.0;
+        acc.name = index_doc_name(si->docs, acc.doc);
+        if (++cursor[sh] == si->workers[sh].numHits) order[0] = order[--live];
+        cursor_sift_down(si, cursor, order, live, 0);
+    }
+    if (acc.doc >= 0) hit_heap_offer(out, &size, k, acc);
+    pthread_mutex_unlock(&si->queryLock);
+    qsort(out, size, sizeof(DocHit), doc_hit_compare);
+    return size;
+}
+
+// --- ALL-PAIRS SIMILARITY ---
+// Every pair of documents in one index, without visiting the N^2 pairs: each
+// document walks the posting lists of its own fingerprints, so only pairs
+// that share something are ever touched and the cost follows the overlap.
+// Documents are handed out to worker threads in small chunks.
+
+#define PAIRS_CHUNK 8 // documents a worker claims at a time
+
+typedef struct {
+    const InvertedIndex *idx;
+    const uint32_t *docStart;   // forward index: doc -> its distinct terms
+    const uint32_t *docTerms;
+    int minShared;
+    int maxDocFreq;
+    int next;                   // next unclaimed document (atomic)
+} PairsJob;
+
+typedef struct {
+    PairsJob *job;
+    PairSimilarity *pairs;      // this worker's output
+    size_t count;
+    size_t cap;
+} PairsWorker;
+
+static void* pairs_worker_main(void *arg) {
+    PairsWorker *wk = arg;
+    PairsJob *job = wk->job;
+    const InvertedIndex *idx = job->idx;
+    int *overlap = calloc(idx->numDocs + 1, sizeof(int));
+    int *touched = malloc(sizeof(int) * (idx->numDocs + 1));
+    for (;;) {
+        int first = __atomic_fetch_add(&job->next, PAIRS_CHUNK, __ATOMIC_RELAXED);
+        if (first >= idx->numDocs) break;
+        int last = first + PAIRS_CHUNK < idx->numDocs ? first + PAIRS_CHUNK : idx->numDocs;
+        for (int a = first; a < last; a++) {
+            int numTouched = 0;
+            for (uint32_t t = job->docStart[a]; t < job->docStart[a + 1]; t++) {
+                uint32_t term = job->docTerms[t];
+                uint32_t begin = idx->termStart[term], end = idx->termStart[term + 1];
+                if (job->maxDocFreq > 0 && end - begin > (uint32_t)job->maxDocFreq) continue;
+                uint32_t lastDoc = (uint32_t)a;
+                for (uint32_t p = begin; p < end; p++) {
+                    uint32_t b = idx->postings[p].doc;
+                    if (b <= lastDoc) continue;     // only b > a, once each
+                    lastDoc = b;
+                    if (overlap[b]++ == 0) touched[numTouched++] = (int)b;
+                }
+            }
+            for (int i = 0; i < numTouched; i++) {
+                int b = touched[i], common = overlap[b];
+                overlap[b] = 0;
+                if (common < job->minShared) continue;
+                if (wk->count == wk->cap) {
+                    wk->cap = wk->cap ? wk->cap * 2 : 1024;
+                    wk->pairs = realloc(wk->pairs, sizeof(PairSimilarity) * wk->cap);
+                }
+                int uni = idx->docFingerprints[a] + idx->docFingerprints[b] - common;
+                wk->pairs[wk->count++] = (PairSimilarity){(uint32_t)a, (uint32_t)b, (uint32_t)common,
+                                                          uni > 0 ? (float)common / uni : 0.0f};
+            }
+        }
+    }
+    free(overlap); free(touched);
+    return NULL;
+}
+
+static int pair_compare(const void *x, const void *y) {
+    const PairSimilarity *p = x, *q = y;
+    if (p->a != q->a) return p->a < q->a ? -1 : 1;
+    return p->b < q->b ? -1 : p->b > q->b;
+}
+
+// Similarity of every document pair sharing at least minShared distinct
+// fingerprints, using numThreads workers. Fingerprints found in more than
+// maxDocFreq postings (0 = no limit) are treated as boilerplate and skipped.
+SimilarityMatrix* all_pairs_similarity(InvertedIndex *idx, int minShared, int maxDocFreq, int numThreads) {
+    index_finalize(idx);
+    if (minShared < 1) minShared = 1;
+    if (numThreads < 1) numThreads = 1;
+
+    // Forward index: each document's distinct terms (postings of one term
+    // are in doc order, so a document repeats only back to back).
+    uint32_t *docStart = calloc(idx->numDocs + 1, sizeof(uint32_t));
+    for (uint32_t t = 0; t < idx->numTerms; t++) {
+        uint32_t lastDoc = UINT32_MAX;
+        for (uint32_t p = idx->termStart[t]; p < idx->termStart[t + 1]; p++) {
+            if (idx->postings[p].doc != lastDoc) docStart[idx->postings[p].doc + 1]++;
+            lastDoc = idx->postings[p].doc;
+        }
+    }
+    for (int d = 0; d < idx->numDocs; d++) docStart[d + 1] += docStart[d];
+    uint32_t *fill = malloc(sizeof(uint32_t) * (idx->numDocs + 1));
+    memcpy(fill, docStart, sizeof(uint32_t) * (idx->numDocs + 1));
+    uint32_t *docTerms = malloc(sizeof(uint32_t) * (docStart[idx->numDocs] + 1));
+    for (uint32_t t = 0; t < idx->numTerms; t++) {
+        uint32_t lastDoc = UINT32_MAX;
+        for (uint32_t p = idx->termStart[t]; p < idx->termStart[t + 1]; p++) {
+            if (idx->postings[p].doc != lastDoc) docTerms[fill[idx->postings[p].doc]++] = t;
+            lastDoc = idx->postings[p].doc;
+        }
+    }
+    free(fill);
+
+    PairsJob job = {idx, docStart, docTerms, minShared, maxDocFreq, 0};
+    PairsWorker *workers = calloc(numThreads, sizeof(PairsWorker));
+    pthread_t *threads = malloc(sizeof(pthread_t) * numThreads);
+    for (int i = 0; i < numThreads; i++) workers[i].job = &job;
+    // The calling thread works as worker 0.
+    for (int i = 1; i < numThreads; i++) pthread_create(&threads[i], NULL, pairs_worker_main, &workers[i]);
+    pairs_worker_main(&workers[0]);
+    for (int i = 1; i < numThreads; i++) pthread_join(threads[i], NULL);
+
+    SimilarityMatrix *m = malloc(sizeof(SimilarityMatrix));
+    m->numDocs = idx->numDocs;
+    m->count = 0;
+    for (int i = 0; i < numThreads; i++) m->count += workers[i].count;
+    m->pairs = malloc(sizeof(PairSimilarity) * (m->count + 1));
+    size_t at = 0;
+    for (int i = 0; i < numThreads; i++) {
+        if (workers[i].count) memcpy(m->pairs + at, workers[i].pairs, sizeof(PairSimilarity) * workers[i].count);
+        at += workers[i].count;
+        free(workers[i].pairs);
+    }
+    qsort(m->pairs, m->count, sizeof(PairSimilarity), pair_compare);
+    free(workers); free(threads); free(docStart); free(docTerms);
+    return m;
+}
+
+void free_similarity_matrix(SimilarityMatrix *m) {
+    if (!m) return;
+    free(m->pairs);
+    free(m);
+}
+
+// --- MINHASH & LSH ---
+// Near-duplicate triage: each document's shingle set (the same hashes the
+// scan uses) shrinks to a fixed-size MinHash signature, and LSH banding puts
+// documents whose signatures agree on a whole band of rows into the same
+// bucket. Only those candidate pairs go on to exact scoring. With b bands of
+// r rows a pair of Jaccard s collides with probability 1 - (1 - s^r)^b,
+// whose steep part sits near (1/b)^(1/r).
+
+MinHasher* create_minhasher(int numHashes, uint64_t seed, bool onePermutation) {
+    MinHasher *mh = malloc(sizeof(MinHasher));
+    mh->numHashes = numHashes > 0 ? numHashes : MINHASH_SIZE;
+    mh->onePermutation = onePermutation;
+    mh->seeds = malloc(sizeof(uint64_t) * mh->numHashes);
+    for (int j = 0; j < mh->numHashes; j++) mh->seeds[j] = mix64(seed += 0x9E3779B97F4A7C15ULL);
+    return mh;
+}
+
+void free_minhasher(MinHasher *mh) {
+    if (!mh) return;
+    free(mh->seeds);
+    free(mh);
+}
+
+// Bin of a 64-bit hash among k, from its top 32 bits (multiply-shift).
+static inline uint32_t minhash_bin(uint64_t h, int k) {
+    return (uint32_t)(((h >> 32) * (uint64_t)k) >> 32);
+}
+
+// One permutation hashing: each shingle is hashed once and only competes for
+// the minimum of its own bin. Empty bins are then filled by optimal
+// densification: bin j borrows from the first non-empty bin in a probe
+// sequence that depends on j alone, so two documents fill the same empty bin
+// from the same source and the estimate stays unbiased.
+static void minhash_signature_oph(const MinHasher *mh, const Fingerprint *hashes, int count, uint64_t *sig) {
+    int k = mh->numHashes, empty = k;
+    for (int j = 0; j < k; j++) sig[j] = UINT64_MAX;
+    for (int i = 0; i < count; i++) {
+        uint64_t h = mix64(fp_key(hashes[i]) ^ mh->seeds[0]);
+        uint32_t bin = minhash_bin(h, k);
+        if (sig[bin] == UINT64_MAX) empty--;
+        if (h < sig[bin]) sig[bin] = h;
+    }
+    if (empty == 0 || empty == k) return;
+
+    uint64_t *filled = malloc(sizeof(uint64_t) * ((k + 63) / 64));
+    for (int j = 0; j < k; j += 64) filled[j / 64] = 0;
+    for (int j = 0; j < k; j++) if (sig[j] != UINT64_MAX) filled[j / 64] |= 1ULL << (j % 64);
+    for (int j = 0; j < k; j++) {
+        if (filled[j / 64] >> (j % 64) & 1) continue;
+        for (uint64_t attempt = 1;; attempt++) {
+            uint32_t src = minhash_bin(mix64(mh->seeds[1 % k] ^ ((uint64_t)j << 32 | attempt)), k);
+            if (filled[src / 64] >> (src % 64) & 1) {
+                sig[j] = sig[src];
+                break;
+            }
+        }
+    }
+    free(filled);
+}
+
+// Writes the numHashes-slot signature of a shingle set (duplicates are
+// harmless) to sig. An empty set gets all-ones slots (see minhash_empty).
+void minhash_signature(const MinHasher *mh, const Fingerprint *hashes, int count, uint64_t *sig) {
+    if (mh->onePermutation) {
+        minhash_signature_oph(mh, hashes, count, sig);
+        return;
+    }
+    for (int j = 0; j < mh->numHashes; j++) sig[j] = UINT64_MAX;
+    for (int i = 0; i < count; i++) {
+        uint64_t key = fp_key(hashes[i]);
+        for (int j = 0; j < mh->numHashes; j++) {
+            uint64_t h = mix64(key ^ mh->seeds[j]);
+            if (h < sig[j]) sig[j] = h;
+        }
+    }
+}
+
+// True for the signature of an empty shingle set (a document shorter than n
+// words). Any non-empty set fills every slot, in either mode.
+bool minhash_empty(const uint64_t *sig, int numHashes) {
+    for (int j = 0; j < numHashes; j++) if (sig[j] != UINT64_MAX) return false;
+    return true;
+}
+
+// Estimated Jaccard similarity: the fraction of equal slots.
+double minhash_estimate(const uint64_t *a, const uint64_t *b, int numHashes) {
+    int equal = 0;
+    for (int j = 0; j < numHashes; j++) equal += a[j] == b[j];
+    return (double)equal / numHashes;
+}
+
+// Picks bands * rows = numHashes whose collision threshold (1/b)^(1/r) is
+// closest to threshold.
+void lsh_choose_bands(int numHashes, double threshold, int *bands, int *rows) {
+    double bestGap = 2.0;
+    *bands = numHashes;
+    *rows = 1;
+    for (int r = 1; r <= numHashes; r++) {
+        if (numHashes % r) continue;
+        int b = numHashes / r;
+        double gap = fabs(pow(1.0 / b, 1.0 / r) - threshold);
+        if (gap < bestGap) {
+            bestGap = gap;
+            *bands = b;
+            *rows = r;
+        }
+    }
+}
+
+// Candidate pairs among numDocs signatures (row-major, numHashes each): pairs
+// sharing a bucket in any band, deduplicated, then kept if their estimate is
+// within two standard errors of threshold. Empty signatures agree on every
+// slot but have nothing to share, so they are left out of the buckets. *out
+// is malloc'd; returns the count.
+size_t lsh_candidates(const uint64_t *sigs, int numDocs, int numHashes, int bands, int rows,
+                      double threshold, CandidatePair **out) {
+    uint64_t *bucket = malloc(sizeof(uint64_t) * (numDocs + 1));
+    uint32_t *docs = malloc(sizeof(uint32_t) * (numDocs + 1));
+    uint32_t *live = malloc(sizeof(uint32_t) * (numDocs + 1));
+    int numLive = 0;
+    for (int d = 0; d < numDocs; d++) {
+        if (!minhash_empty(sigs + (size_t)d * numHashes, numHashes)) live[numLive++] = (uint32_t)d;
+    }
+    size_t count = 0, cap = 1024;
+    uint64_t *pairs = malloc(sizeof(uint64_t) * cap);    // a << 32 | b
+    for (int band = 0; band < bands; band++) {
+        for (int i = 0; i < numLive; i++) {
+            const uint64_t *row = sigs + (size_t)live[i] * numHashes + (size_t)band * rows;
+            uint64_t h = (uint64_t)band;
+            for (int r = 0; r < rows; r++) h = mix64(h ^ row[r]);
+            bucket[i] = h;
+            docs[i] = live[i];
+        }
+        radix_sort(NULL, bucket, docs, numLive);    // stable: docs ascending per bucket
+        for (int start = 0, end; start < numLive; start = end) {
+            for (end = start + 1; end < numLive && bucket[end] == bucket[start]; end++) {}
+            for (int i = start; i < end; i++) {
+                for (int j = i + 1; j < end; j++) {
+                    if (count == cap) pairs = realloc(pairs, sizeof(uint64_t) * (cap *= 2));
+                    pairs[count++] = (uint64_t)docs[i] << 32 | docs[j];
+                }
+            }
+        }
+    }
+    free(bucket); free(docs); free(live);
+
+    radix_sort(NULL, pairs, NULL, (int)count);
+    double cutoff = threshold - 2.0 * sqrt(threshold * (1.0 - threshold) / numHashes);
+    CandidatePair *result = malloc(sizeof(CandidatePair) * (count + 1));
+    size_t kept = 0;
+    for (size_t i = 0; i < count; i++) {
+        if (i > 0 && pairs[i] == pairs[i - 1]) continue;
+        uint32_t a = (uint32_t)(pairs[i] >> 32), b = (uint32_t)pairs[i];
+        double est = minhash_estimate(sigs + (size_t)a * numHashes, sigs + (size_t)b * numHashes, numHashes);
+        if (est >= cutoff) result[kept++] = (CandidatePair){a, b, (float)est};
+    }
+    free(pairs);
+    *out = result;
+    return kept;
+}
+
+// --- B-BIT SIGNATURES ---
+// Keeping only the low b bits of each slot shrinks a 128-slot signature from
+// 1 KB to 16 * b bytes. Slots of two signatures agree wherever no bit plane
+// differs, so matches = k - popcount(OR_p (A_p ^ B_p)); pad bits are zero in
+// every signature and never count as a difference.
+
+typedef int (*BbitKernel)(const uint64_t *a, const uint64_t *b, int bits, int words);
+
+int bbit_diff_scalar(const uint64_t *a, const uint64_t *b, int bits, int words) {
+    int diff = 0;
+    for (int w = 0; w < words; w++) {
+        uint64_t x = 0;
+        for (int p = 0; p < bits; p++) x |= a[p * words + w] ^ b[p * words + w];
+        diff += __builtin_popcountll(x);
+    }
+    return diff;
+}
+
+#ifdef HAVE_X86_SIMD
+__attribute__((target("popcnt")))
+int bbit_diff_popcnt(const uint64_t *a, const uint64_t *b, int bits, int words) {
+    int diff = 0;
+    for (int w = 0; w < words; w++) {
+        uint64_t x = 0;
+        for (int p = 0; p < bits; p++) x |= a[p * words + w] ^ b[p * words + w];
+        diff += (int)_mm_popcnt_u64(x);
+    }
+    return diff;
+}
+
+// Four words per step; bytes are counted with a nibble lookup table
+// (vpshufb) and summed with vpsadbw, since AVX2 has no vector popcount.
+__attribute__((target("avx2,popcnt")))
+int bbit_diff_avx2(const uint64_t *a, const uint64_t *b, int bits, int words) {
+    const __m256i lut = _mm256_setr_epi8(0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4,
+                                         0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+    const __m256i low = _mm256_set1_epi8(0x0F);
+    __m256i acc = _mm256_setzero_si256();
+    int w = 0;
+    for (; w + 4 <= words; w += 4) {
+        __m256i x = _mm256_setzero_si256();
+        for (int p = 0; p < bits; p++) {
+            __m256i va = _mm256_loadu_si256((const __m256i *)(a + p * words + w));
+            __m256i vb = _mm256_loadu_si256((const __m256i *)(b + p * words + w));
+            x = _mm256_or_si256(x, _mm256_xor_si256(va, vb));
+        }
+        __m256i cnt = _mm256_add_epi8(_mm256_shuffle_epi8(lut, _mm256_and_si256(x, low)),
+                                      _mm256_shuffle_epi8(lut, _mm256_and_si256(_mm256_srli_epi16(x, 4), low)));
+        acc = _mm256_add_epi64(acc, _mm256_sad_epu8(cnt, _mm256_setzero_si256()));
+    }
+    int diff = (int)(_mm256_extract_epi64(acc, 0) + _mm256_extract_epi64(acc, 1) +
+                     _mm256_extract_epi64(acc, 2) + _mm256_extract_epi64(acc, 3));
+    for (; w < words; w++) {
+        uint64_t x = 0;
+        for (int p = 0; p < bits; p++) x |= a[p * words + w] ^ b[p * words + w];
+        diff += (int)_mm_popcnt_u64(x);
+    }
+    return diff;
+}
+#endif
+
+BbitKernel select_bbit_kernel(void) {
+#ifdef HAVE_X86_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("popcnt")) return bbit_diff_avx2;
+    if (__builtin_cpu_supports("popcnt")) return bbit_diff_popcnt;
+#endif
+    return bbit_diff_scalar;
+}
+
+// bits is clamped to 1..16.
+BbitSignatures* create_bbit_signatures(int numHashes, int bits, size_t expected) {
+    BbitSignatures *s = malloc(sizeof(BbitSignatures));
+    s->numHashes = numHashes;
+    s->bits = bits < 1 ? 1 : bits > 16 ? 16 : bits;
+    s->words = (numHashes + 63) / 64;
+    s->count = 0;
+    s->cap = expected > 0 ? expected : 16;
+    s->data = malloc(sizeof(uint64_t) * s->cap * s->bits * s->words);
+    return s;
+}
+
+void free_bbit_signatures(BbitSignatures *s) {
+    if (!s) return;
+    free(s->data);
+    free(s);
+}
+
+static inline const uint64_t* bbit_row(const BbitSignatures *s, size_t i) {
+    return s->data + i * s->bits * s->words;
+}
+
+// Packs a full signature into the next row; returns its index.
+size_t bbit_add(BbitSignatures *s, const uint64_t *sig) {
+    if (s->count == s->cap) {
+        s->cap *= 2;
+        s->data = realloc(s->data, sizeof(uint64_t) * s->cap * s->bits * s->words);
+    }
+    uint64_t *row = s->data + s->count * s->bits * s->words;
+    memset(row, 0, sizeof(uint64_t) * s->bits * s->words);
+    for (int j = 0; j < s->numHashes; j++) {
+        for (int p = 0; p < s->bits; p++) row[p * s->words + j / 64] |= (sig[j] >> p & 1) << (j % 64);
+    }
+    return s->count++;
+}
+
+// Estimated Jaccard of rows a and b. Unrelated slots still agree on their low
+// b bits with probability 2^-b, so the match rate P is corrected to
+// (P - 2^-b) / (1 - 2^-b).
+double bbit_estimate(const BbitSignatures *s, size_t a, size_t b) {
+    static BbitKernel kernel = NULL;
+    if (!kernel) kernel = select_bbit_kernel();
+    double match = 1.0 - (double)kernel(bbit_row(s, a), bbit_row(s, b), s->bits, s->words) / s->numHashes;
+    double chance = ldexp(1.0, -s->bits);
+    double j = (match - chance) / (1.0 - chance);
+    return j > 0.0 ? j : 0.0;
+}
+
+// --- SIMHASH ---
+// A 64-bit summary of a shingle multiset: every shingle occurrence votes +1
+// or -1 on each bit according to its own mixed hash, so a shingle repeated
+// f times weighs f. Similar texts get hashes a small Hamming distance apart.
+
+uint64_t simhash(const Fingerprint *hashes, int count) {
+    int32_t weight[64] = {0};
+    for (int i = 0; i < count; i++) {
+        uint64_t h = mix64(fp_key(hashes[i]));
+        for (int b = 0; b < 64; b++) weight[b] += (int32_t)((h >> b) & 1) * 2 - 1;
+    }
+    uint64_t out = 0;
+    for (int b = 0; b < 64; b++) if (weight[b] > 0) out |= 1ULL << b;
+    return out;
+}
+
+// SimHashes of the paragraphs of raw text (separated by blank lines) with at
+// least n words, up to max; returns how many. Scratch lives in arena.
+int simhash_paragraphs(Arena *arena, const char *text, Lexicon *lex, int n, uint64_t *out, int max) {
+    int count = 0;
+    const char *p = text;
+    while (*p && count < max) {
+        const char *end = p;
+        while (*end) {
+            if (*end++ != '\n') continue;
+            const char *q = end;
+            while (*q == ' ' || *q == '\t' || *q == '\r') q++;
+            if (*q == '\n' || !*q) break;
+        }
+        size_t len = (size_t)(end - p);
+        char *para = mem_alloc(arena, len + 1);
+        memcpy(para, p, len);
+        para[len] = '\0';
+        char *clean = preprocess(arena, para);
+        TokenList tl;
+        int wc = tokenize(arena, clean, lex, &tl);
+        if (wc >= n) {
+            Fingerprint *hashes = mem_alloc(arena, sizeof(Fingerprint) * (wc + 1));
+            out[count++] = simhash(hashes, rolling_hashes(&tl, n, hashes));
+            mem_free(arena, hashes);
+        }
+        free_tokens(&tl);
+        mem_free(arena, clean); mem_free(arena, para);
+        p = end;
+    }
+    return count;
+}
+
+static inline uint64_t rotl64(uint64_t x, int r) {
+    return r ? x << r | x >> (64 - r) : x;
+}
+
+// maxDistance is clamped to 0..SIMHASH_MAX_TABLES - 1.
+SimHashIndex* create_simhash_index(int maxDistance) {
+    SimHashIndex *idx = calloc(1, sizeof(SimHashIndex));
+    if (maxDistance < 0) maxDistance = 0;
+    if (maxDistance > SIMHASH_MAX_TABLES - 1) maxDistance = SIMHASH_MAX_TABLES - 1;
+    idx->maxDistance = maxDistance;
+    idx->numTables = maxDistance + 1;
+    for (int t = 0, start = 0; t < idx->numTables; t++) {
+        idx->blockStart[t] = start;
+        idx->blockBits[t] = 64 / idx->numTables + (t < 64 % idx->numTables);
+        start += idx->blockBits[t];
+    }
+    idx->cap = 1024;
+    idx->hashes = malloc(sizeof(uint64_t) * idx->cap);
+    idx->ids = malloc(sizeof(uint32_t) * idx->cap);
+    return idx;
+}
+
+void free_simhash_index(SimHashIndex *idx) {
+    if (!idx) return;
+    for (int t = 0; t < idx->numTables; t++) {
+        free(idx->keys[t]);
+        free(idx->vals[t]);
+    }
+    free(idx->hashes); free(idx->ids);
+    free(idx);
+}
+
+// Entries become visible to queries at the next simhash_index_build.
+void simhash_index_add(SimHashIndex *idx, uint64_t hash, uint32_t id) {
+    if (idx->count == idx->cap) {
+        idx->cap *= 2;
+        idx->hashes = realloc(idx->hashes, sizeof(uint64_t) * idx->cap);
+        idx->ids = realloc(idx->ids, sizeof(uint32_t) * idx->cap);
+    }
+    idx->hashes[idx->count] = hash;
+    idx->ids[idx->count++] = id;
+}
+
+void simhash_index_build(SimHashIndex *idx) {
+    for (int t = 0; t < idx->numTables; t++) {
+        int rot = 64 - idx->blockStart[t] - idx->blockBits[t];
+        idx->keys[t] = realloc(idx->keys[t], sizeof(uint64_t) * (idx->count + 1));
+        idx->vals[t] = realloc(idx->vals[t], sizeof(uint32_t) * (idx->count + 1));
+        for (size_t i = 0; i < idx->count; i++) {
+            idx->keys[t][i] = rotl64(idx->hashes[i], rot);
+            idx->vals[t][i] = idx->ids[i];
+        }
+        radix_sort(NULL, idx->keys[t], idx->vals[t], (int)idx->count);
+    }
+    idx->built = idx->count;
+}
+
+// Entries within maxDistance of q, each reported once (by the first table
+// whose block matches), up to max; returns how many.
+int simhash_index_query(const SimHashIndex *idx, uint64_t q, SimHashMatch *out, int max) {
+    int found = 0;
+    for (int t = 0; t < idx->numTables && found < max; t++) {
+        int rot = 64 - idx->blockStart[t] - idx->blockBits[t];
+        uint64_t rq = rotl64(q, rot), top = ~0ULL << (64 - idx->blockBits[t]);
+        const uint64_t *keys = idx->keys[t];
+        int n = (int)idx->built;
+        for (int i = gallop_lower(keys, 0, n, rq & top); i < n && (keys[i] & top) == (rq & top); i++) {
+            int d = __builtin_popcountll(keys[i] ^ rq);
+            if (d > idx->maxDistance) continue;
+            uint64_t diff = rotl64(keys[i] ^ rq, (64 - rot) % 64);
+            bool seen = false;
+            for (int s = 0; s < t && !seen; s++) {
+                uint64_t mask = (idx->blockBits[s] == 64 ? ~0ULL : (1ULL << idx->blockBits[s]) - 1) << idx->blockStart[s];
+                seen = (diff & mask) == 0;
+            }
+            if (seen) continue;
+            out[found++] = (SimHashMatch){idx->vals[t][i], d};
+            if (found == max) break;
+        }
+    }
+    return found;
+}
+
+// --- BENCHMARKS ---
+// Built with -DTEXTGUARD_BENCH=1; main() then runs these and exits.
+
+#if TEXTGUARD_BENCH
+double bench_now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// Deterministic pseudo-random fingerprints (splitmix64), valid for either family.
+Fingerprint bench_fingerprint(uint64_t *state) {
+    uint64_t z = (*state += 0x9E3779B97F4A7C15ULL);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    z ^= z >> 31;
+#if HASH_M61
+    return (Fingerprint){z & MOD61};
+#else
+    return (Fingerprint){(long long)((z >> 32) % MOD1), (long long)((z & 0xFFFFFFFF) % MOD2)};
+#endif
+}
+
+// The pre-SwissTable set: fixed TABLE_SIZE slots, modulo index, linear probing.
+typedef struct {
+    Fingerprint *items;
+    bool *occupied;
+    int capacity;
+    int size;
+} LegacySet;
+
+LegacySet* create_legacy_set() {
+    LegacySet *fs = malloc(sizeof(LegacySet));
+    fs->capacity = TABLE_SIZE;
+    fs->items = malloc(sizeof(Fingerprint) * TABLE_SIZE);
+    fs->occupied = calloc(TABLE_SIZE, sizeof(bool));
+    fs->size = 0;
+    return fs;
+}
+
+void legacy_insert(LegacySet *fs, Fingerprint f) {
+    int idx = (int)((uint64_t)f.h1 % fs->capacity);
+    while (fs->occupied[idx]) {
+        if (fp_equal(fs->items[idx], f)) return;
+        idx = (idx + 1) % fs->capacity;
+    }
+    fs->items[idx] = f;
+    fs->occupied[idx] = true;
+    fs->size++;
+}
+
+bool legacy_contains(LegacySet *fs, Fingerprint f) {
+    int idx = (int)((uint64_t)f.h1 % fs->capacity);
+    while (fs->occupied[idx]) {
+        if (fp_equal(fs->items[idx], f)) return true;
+        idx = (idx + 1) % fs->capacity;
+    }
+    return false;
+}
+
+// Inserts count fingerprints, then looks up count present and count absent ones.
+void bench_sets(int count) {
+    Fingerprint *keys = malloc(sizeof(Fingerprint) * count * 2);
+    uint64_t state = 42;
+    for (int i = 0; i < count * 2; i++) keys[i] = bench_fingerprint(&state);
+    int hits = 0;
+
+    if (count < TABLE_SIZE * 9 / 10) {
+        LegacySet *ls = create_legacy_set();
+        double t0 = bench_now();
+        for (int i = 0; i < count; i++) legacy_insert(ls, keys[i]);
+        double t1 = bench_now();
+        for (int i = 0; i < count * 2; i++) hits += legacy_contains(ls, keys[i]);
+        double t2 = bench_now();
+        printf("  legacy  n=%-8d insert %7.1f ns/op   lookup %7.1f ns/op\n",
+               count, (t1 - t0) * 1e9 / count, (t2 - t1) * 1e9 / (count * 2));
+        free(ls->items); free(ls->occupied); free(ls);
+    } else {
+        printf("  legacy  n=%-8d (does not fit in TABLE_SIZE)\n", count);
+    }
+
+    FingerprintSet *fs = create_set(NULL);
+    double t0 = bench_now();
+    for (int i = 0; i < count; i++) set_insert(fs, keys[i]);
+    double t1 = bench_now();
+    for (int i = 0; i < count * 2; i++) hits += set_contains(fs, keys[i]);
+    double t2 = bench_now();
+    printf("  swiss   n=%-8d insert %7.1f ns/op   lookup %7.1f ns/op   (capacity %zu)\n",
+           count, (t1 - t0) * 1e9 / count, (t2 - t1) * 1e9 / (count * 2), fs->capacity);
+    free_set(fs);
+    free(keys);
+    if (hits < 0) printf("%d\n", hits); // keep the lookups observable
+}
+
+// Measured false-positive rate and check cost of the blocked Bloom filter.
+void bench_bloom(int count, double fpr) {
+    uint64_t state = 7;
+    BloomFilter *bf = create_bloom(NULL, count, fpr);
+    for (int i = 0; i < count; i++) bloom_add(bf, bench_fingerprint(&state));
+    Fingerprint *probes = malloc(sizeof(Fingerprint) * count);
+    for (int i = 0; i < count; i++) probes[i] = bench_fingerprint(&state);
+    int positives = 0;
+    double t0 = bench_now();
+    for (int i = 0; i < count; i++) positives += bloom_check(bf, probes[i]);
+    double t1 = bench_now();
+    printf("  n=%-8d target %.3f  measured %.4f  k=%-2d  %6.1f KB  check %5.1f ns/op\n",
+           count, fpr, (double)positives / count, bf->k, bf->numBlocks * 64 / 1024.0,
+           (t1 - t0) * 1e9 / count);
+    free(probes);
+    free_bloom(bf);
+}
+
+// Same measurement for the binary fuse filter.
+void bench_fuse(int count) {
+    uint64_t state = 7;
+    uint64_t *keys = malloc(sizeof(uint64_t) * count);
+    for (int i = 0; i < count; i++) keys[i] = fp_key(bench_fingerprint(&state));
+    double t0 = bench_now();
+    FuseFilter *ff = create_fuse_filter(NULL, keys, count);
+    double t1 = bench_now();
+    Fingerprint *probes = malloc(sizeof(Fingerprint) * count);
+    for (int i = 0; i < count; i++) probes[i] = bench_fingerprint(&state);
+    int positives = 0;
+    double t2 = bench_now();
+    for (int i = 0; i < count; i++) positives += fuse_check(ff, probes[i]);
+    double t3 = bench_now();
+    printf("  n=%-8d measured %.4f  %.2f bits/key  %6.1f KB  build %6.1f ms  check %5.1f ns/op\n",
+           count, (double)positives / count, ff->arrayLength * 8.0 / count, ff->arrayLength / 1024.0,
+           (t1 - t0) * 1e3, (t3 - t2) * 1e9 / count);
+    free(probes); free(keys);
+    free_fuse_filter(ff);
+}
+
+// Repeats a whole document comparison (preprocess, tokenize, fingerprint,
+// set + Bloom filter, scan, top-K) with every per-comparison allocation on
+// the heap and then in one arena reset between rounds. The lexicon is shared
+// by all rounds, as in a long-running checker.
+void bench_arena(int words, int rounds) {
+    uint64_t state = 11;
+    char *docA = malloc((size_t)words * 8 + 1), *docB = malloc((size_t)words * 8 + 1);
+    char *pa = docA, *pb = docB;
+    for (int i = 0; i < words; i++) {
+        uint64_t r = mix64(state += 0x9E3779B97F4A7C15ULL);
+        pa += sprintf(pa, "w%u ", (unsigned)(r % 5000));
+        pb += sprintf(pb, "w%u ", (unsigned)(r % 3 ? r % 5000 : (r >> 32) % 5000));
+    }
+    Lexicon *lex = create_lexicon();
+    Arena *arena = create_arena(0);
+    FreqEntry top[TOP_K];
+    for (int pass = 0; pass < 2; pass++) {
+        Arena *a = pass ? arena : NULL;
+        long long matches = 0;
+        double t0 = bench_now();
+        for (int r = 0; r < rounds; r++) {
+            char *cleanA = preprocess(a, docA), *cleanB = preprocess(a, docB);
+            TokenList tokA, tokB;
+            int wcA = tokenize(a, cleanA, lex, &tokA), wcB = tokenize(a, cleanB, lex, &tokB);
+            WinnowedFingerprint *winA = mem_alloc(a, sizeof(WinnowedFingerprint) * (wcA + 1));
+            int numWinA;
+            fingerprint_tokens(&tokA, 3, 3, NULL, winA, &numWinA);
+            FingerprintSet *fs = create_set(a);
+            BloomFilter *bf = create_bloom(a, numWinA, BLOOM_FPR);
+            for (int i = 0; i < numWinA; i++) {
+                set_insert(fs, winA[i].fp);
+                bloom_add(bf, winA[i].fp);
+            }
+            Fingerprint *hashesB = mem_alloc(a, sizeof(Fingerprint) * (wcB + 1));
+            int numHashesB = rolling_hashes(&tokB, 3, hashesB);
+            PhraseTally *tally = tally_create(a, TOP_K, TIE_FIRST_POSITION);
+            for (int i = 0; i < numHashesB; i++) {
+                if (bloom_check(bf, hashesB[i]) && set_contains(fs, hashesB[i])) {
+                    tally_update(tally, hashesB[i], i, 0);
+                    matches++;
+                }
+            }
+            matches += tally_top(tally, top);
+            if (a) {
+                arena_reset(a);
+            } else {
+                tally_free(tally); free_bloom(bf); free_set(fs);
+                free(hashesB); free(winA);
+                free_tokens(&tokA); free_tokens(&tokB);
+                free(cleanA); free(cleanB);
+            }
+        }
+        double t1 = bench_now();
+        printf("  %-5s words=%-8d %8.1f us/comparison  (%lld)\n", pass ? "arena" : "heap", words,
+               (t1 - t0) * 1e6 / rounds, matches / rounds);
+    }
+    printf("  arena footprint %.1f KB\n", arena_footprint(arena) / 1024.0);
+    free_arena(arena); free_lexicon(lex);
+    free(docA); free(docB);
+}
+
+// One reference/suspect comparison both ways: hashing (set + Bloom filter,
+// probe every suspect key) and sorting (radix sort both sides, intersect).
+// shared is the fraction of suspect keys drawn from the reference.
+void bench_intersect(int numRef, int numSuspect, double shared) {
+    uint64_t state = 5;
+    Fingerprint *ref = malloc(sizeof(Fingerprint) * numRef);
+    Fingerprint *sus = malloc(sizeof(Fingerprint) * numSuspect);
+    for (int i = 0; i < numRef; i++) ref[i] = bench_fingerprint(&state);
+    for (int i = 0; i < numSuspect; i++) {
+        sus[i] = (double)(bench_fingerprint(&state).h1 % 1000) < shared * 1000
+                 ? ref[bench_fingerprint(&state).h1 % numRef] : bench_fingerprint(&state);
+    }
+    Arena *arena = create_arena(0);
+
+    double t0 = bench_now();
+    FingerprintSet *fs = create_set(arena);
+    BloomFilter *bf = create_bloom(arena, numRef, BLOOM_FPR);
+    for (int i = 0; i < numRef; i++) {
+        set_insert(fs, ref[i]);
+        bloom_add(bf, ref[i]);
+    }
+    int hashHits = 0;
+    for (int i = 0; i < numSuspect; i++) hashHits += bloom_check(bf, sus[i]) && set_contains(fs, sus[i]);
+    double t1 = bench_now();
+    arena_reset(arena);
+
+    double t2 = bench_now();
+    uint64_t *a = arena_alloc(arena, sizeof(uint64_t) * numRef, 16);
+    uint64_t *b = arena_alloc(arena, sizeof(uint64_t) * numSuspect, 16);
+    int *hit = arena_alloc(arena, sizeof(int) * numSuspect, 16);
+    for (int i = 0; i < numRef; i++) a[i] = fp_key(ref[i]);
+    for (int i = 0; i < numSuspect; i++) b[i] = fp_key(sus[i]);
+    radix_sort(arena, a, NULL, numRef);
+    int na = 0;
+    for (int i = 0; i < numRef; i++) if (na == 0 || a[na - 1] != a[i]) a[na++] = a[i];
+    radix_sort(arena, b, NULL, numSuspect);
+    int mergeHits = intersect_sorted(a, na, b, numSuspect, hit);
+    double t3 = bench_now();
 
+    printf("  ref=%-8d suspect=%-8d hash %7.2f ms   merge-join %7.2f ms   matches %d%s\n",
+           numRef, numSuspect, (t1 - t0) * 1e3, (t3 - t2) * 1e3, mergeHits,
+           mergeHits == hashHits ? "" : " (MISMATCH)");
+    free_arena(arena);
+    free(ref); free(sus);
+}
 
-typedef struct {
-    unsigned char *bits;
-    int size;
-} BloomFilter;
+// Corpus query latency, serial index_query against sharded_query at
+// increasing shard counts (worker threads), with the results cross-checked.
+void bench_sharded(int numDocs, int fpsPerDoc, int suspectLen) {
+    uint64_t state = 13;
+    InvertedIndex *idx = create_index();
+    WinnowedFingerprint *win = malloc(sizeof(WinnowedFingerprint) * fpsPerDoc);
+    uint64_t universe = (uint64_t)numDocs * fpsPerDoc / 4;
+    for (int d = 0; d < numDocs; d++) {
+        for (int i = 0; i < fpsPerDoc; i++) {
+            win[i].fp = fp_const((long long)(bench_fingerprint(&state).h1 % universe));
+            win[i].pos = i;
+        }
+        index_add_document(idx, NULL, "doc", win, fpsPerDoc);
+    }
+    index_build_filter(idx);
+    Fingerprint *suspect = malloc(sizeof(Fingerprint) * suspectLen);
+    for (int i = 0; i < suspectLen; i++) suspect[i] = fp_const((long long)(bench_fingerprint(&state).h1 % (universe * 2)));
 
-typedef struct {
-    Fingerprint *items;
-    bool *occupied;
-    int capacity;
-    int size;
-} FingerprintSet;
+    DocHit serial[TOP_K], sharded[TOP_K];
+    double t0 = bench_now();
+    int numSerial = index_query(idx, NULL, suspect, suspectLen, TOP_K, serial);
+    double t1 = bench_now();
+    printf("  docs=%-6d suspect=%-7d serial      %7.2f ms\n", numDocs, suspectLen, (t1 - t0) * 1e3);
+    for (int shards = 1; shards <= 2 * default_shard_count() && shards <= MAX_SHARDS; shards *= 2) {
+        double t2 = bench_now();
+        ShardedIndex *si = create_sharded_index(idx, shards);
+        double t3 = bench_now();
+        sharded_query(si, suspect, suspectLen, TOP_K, sharded);    // warm up the workers
+        double t4 = bench_now();
+        int numSharded = sharded_query(si, suspect, suspectLen, TOP_K, sharded);
+        double t5 = bench_now();
+        bool same = numSharded == numSerial;
+        for (int h = 0; same && h < numSerial; h++) same = sharded[h].doc == serial[h].doc && sharded[h].matches == serial[h].matches;
+        printf("  %26s shards=%-3d %7.2f ms  (setup %.2f ms)%s\n", "", shards, (t5 - t4) * 1e3, (t3 - t2) * 1e3,
+               same ? "" : "  (MISMATCH)");
+        free_sharded_index(si);
+    }
+    free(suspect); free(win);
+    free_index(idx);
+}
 
-// Structure to track how many times a matching phrase appeared
-typedef struct {
-    Fingerprint fp;
-    char phrase[MAX_WORD_LEN * 5]; // Store actual text for display
-    int frequency;
-    bool occupied;
-} FreqEntry;
+// All-pairs over a synthetic cohort: pairs emitted versus the N^2/2 a
+// pairwise loop would run, and time per thread count.
+void bench_all_pairs(int numDocs, int fpsPerDoc) {
+    uint64_t state = 17;
+    InvertedIndex *idx = create_index();
+    WinnowedFingerprint *win = malloc(sizeof(WinnowedFingerprint) * fpsPerDoc);
+    for (int d = 0; d < numDocs; d++) {
+        // Every tenth document copies part of the previous one.
+        uint64_t copyState = state;
+        for (int i = 0; i < fpsPerDoc; i++) {
+            win[i].fp = d % 10 == 1 && i < fpsPerDoc / 3 ? win[i].fp : bench_fingerprint(&copyState);
+            win[i].pos = i;
+        }
+        state = copyState;
+        index_add_document(idx, NULL, "doc", win, fpsPerDoc);
+    }
+    for (int threads = 1; threads <= online_cores(); threads *= 2) {
+        double t0 = bench_now();
+        SimilarityMatrix *m = all_pairs_similarity(idx, 1, 0, threads);
+        double t1 = bench_now();
+        printf("  docs=%-6d threads=%-3d %8.2f ms   %zu nonzero of %lld pairs\n", numDocs, threads,
+               (t1 - t0) * 1e3, m->count, (long long)numDocs * (numDocs - 1) / 2);
+        free_similarity_matrix(m);
+    }
+    free(win);
+    free_index(idx);
+}
 
-//ranking plagiarism intensity
-typedef struct {
-    FreqEntry *table;
-    int capacity;
-} FrequencyMap;
+// numDocs random shingle sets where every tenth document shares ~70% of its
+// shingles with the previous one (Jaccard ~0.54); reports LSH recall of those
+// planted pairs and how many candidates survive.
+void bench_minhash(int numDocs, int shinglesPerDoc, double threshold, bool onePermutation) {
+    uint64_t state = 23;
+    MinHasher *mh = create_minhasher(MINHASH_SIZE, 1, onePermutation);
+    uint64_t *sigs = malloc(sizeof(uint64_t) * MINHASH_SIZE * numDocs);
+    Fingerprint *shingles = malloc(sizeof(Fingerprint) * shinglesPerDoc);
+    double t0 = bench_now();
+    for (int d = 0; d < numDocs; d++) {
+        uint64_t copyState = state;
+        for (int i = 0; i < shinglesPerDoc; i++) {
+            Fingerprint fp = bench_fingerprint(&copyState);
+            if (!(d % 10 == 1 && i < shinglesPerDoc * 7 / 10)) shingles[i] = fp;
+        }
+        state = copyState;
+        minhash_signature(mh, shingles, shinglesPerDoc, sigs + (size_t)d * MINHASH_SIZE);
+    }
+    double t1 = bench_now();
+    int bands, rows;
+    lsh_choose_bands(MINHASH_SIZE, threshold, &bands, &rows);
+    CandidatePair *cand;
+    size_t count = lsh_candidates(sigs, numDocs, MINHASH_SIZE, bands, rows, threshold, &cand);
+    double t2 = bench_now();
+    int found = 0;
+    for (size_t i = 0; i < count; i++) found += cand[i].b == cand[i].a + 1 && cand[i].b % 10 == 1;
+    printf("  %s docs=%-6d t=%.2f (%dx%d)  sign %7.2f ms  lsh %7.2f ms  %zu candidates  recall %d/%d\n",
+           onePermutation ? "one-perm" : "k-hash  ", numDocs, threshold, bands, rows, (t1 - t0) * 1e3, (t2 - t1) * 1e3, count, found, (numDocs + 8) / 10);
+    free(cand); free(shingles); free(sigs);
+    free_minhasher(mh);
+}
 
-// --- UTILITIES ---
+// numDocs one-permutation signatures of 200-shingle sets, the i-th sharing
+// a growing share with the query. Reports packing and scan time plus the
+// mean absolute error of the b-bit estimate against the full signature.
+void bench_bbit(int numDocs, int bits) {
+    uint64_t state = 29;
+    MinHasher *mh = create_minhasher(MINHASH_SIZE, 1, true);
+    Fingerprint query[200], shingles[200];
+    uint64_t qsig[MINHASH_SIZE], sig[MINHASH_SIZE];
+    for (int i = 0; i < 200; i++) query[i] = bench_fingerprint(&state);
+    minhash_signature(mh, query, 200, qsig);
+    bool full = bits >= 64;
+    BbitSignatures *s = create_bbit_signatures(MINHASH_SIZE, full ? 16 : bits, numDocs + 1);
+    uint64_t *fullSigs = full ? malloc(sizeof(uint64_t) * MINHASH_SIZE * numDocs) : NULL;
+    bbit_add(s, qsig);
+    double err = 0.0, t0 = bench_now();
+    for (int d = 0; d < numDocs; d++) {
+        int same = d % 200;
+        for (int i = 0; i < 200; i++) shingles[i] = i < same ? query[i] : bench_fingerprint(&state);
+        minhash_signature(mh, shingles, 200, sig);
+        if (full) memcpy(fullSigs + (size_t)d * MINHASH_SIZE, sig, sizeof(sig));
+        else bbit_add(s, sig);
+    }
+    double t1 = bench_now();
+    size_t over = 0;
+    for (int d = 0; d < numDocs; d++) {
+        double est = full ? minhash_estimate(qsig, fullSigs + (size_t)d * MINHASH_SIZE, MINHASH_SIZE)
+                          : bbit_estimate(s, 0, d + 1);
+        over += est >= 0.5;
+    }
+    double t2 = bench_now();
+    // Accuracy on a sample, against the exact Jaccard of the construction.
+    for (int d = 0; d < 200; d++) err += fabs((full ? minhash_estimate(qsig, fullSigs + (size_t)d * MINHASH_SIZE, MINHASH_SIZE)
+                                                    : bbit_estimate(s, 0, d + 1)) - d / (400.0 - d));
+    size_t bytes = full ? sizeof(uint64_t) * MINHASH_SIZE : sizeof(uint64_t) * s->bits * s->words;
+    printf("  b=%-2d docs=%-8d %5zu B/sig  build %8.2f ms  scan %7.2f ms  %zu >= 0.5  mean |err| %.3f\n",
+           bits, numDocs, bytes, (t1 - t0) * 1e3, (t2 - t1) * 1e3, over, err / 200);
+    free(fullSigs);
+    free_bbit_signatures(s);
+    free_minhasher(mh);
+}
 
-// Function to read entire file content into a string
-char* read_file(const char* filename) {
-    FILE *f = fopen(filename, "rb");
-    if (!f) return NULL;
-    fseek(f, 0, SEEK_END);
-    long length = ftell(f);
-    fseek(f, 0, SEEK_SET);
-    char *buffer = malloc(length + 1);
-    if (buffer) {
-        fread(buffer, 1, length, f);
-        buffer[length] = '\0';
+// numDocs random SimHashes plus, for each of 1000 queries, a planted copy
+// with `radius` bits flipped; compares index lookups with a linear scan.
+void bench_simhash(int numDocs, int radius) {
+    uint64_t state = 31;
+    SimHashIndex *sh = create_simhash_index(radius);
+    uint64_t *all = malloc(sizeof(uint64_t) * (numDocs + 1000));
+    uint64_t queries[1000];
+    for (int d = 0; d < numDocs; d++) simhash_index_add(sh, all[d] = mix64(state += 0x9E3779B97F4A7C15ULL), d);
+    for (int q = 0; q < 1000; q++) {
+        uint64_t h = queries[q] = mix64(state += 0x9E3779B97F4A7C15ULL);
+        for (int f = 0; f < radius; f++) h ^= 1ULL << (mix64(state += 1) % 64);
+        simhash_index_add(sh, all[numDocs + q] = h, numDocs + q);
     }
-    fclose(f);
-    return buffer;
+    int total = numDocs + 1000;
+    double t0 = bench_now();
+    simhash_index_build(sh);
+    double t1 = bench_now();
+    SimHashMatch found[64];
+    int recall = 0;
+    for (int q = 0; q < 1000; q++) {
+        int numFound = simhash_index_query(sh, queries[q], found, 64);
+        for (int i = 0; i < numFound; i++) recall += found[i].id == (uint32_t)(numDocs + q);
+    }
+    double t2 = bench_now();
+    int linear = 0;
+    for (int q = 0; q < 100; q++) {
+        for (int d = 0; d < total; d++) linear += __builtin_popcountll(all[d] ^ queries[q]) <= radius;
+    }
+    double t3 = bench_now();
+    printf("  docs=%-8d k=%d  build %8.2f ms  lookup %7.2f us  linear %9.2f us  recall %d/1000 (linear: %d)\n",
+           total, radius, (t1 - t0) * 1e3, (t2 - t1) * 1e6 / 1000, (t3 - t2) * 1e6 / 100, recall, linear);
+    free(all);
+    free_simhash_index(sh);
 }
 
-char* preprocess(const char *text) {
-    char *clean = malloc(strlen(text) + 1);
-    int j = 0;
-    for (int i = 0; text[i]; i++) {
-        if (isalnum(text[i])) clean[j++] = (char)tolower(text[i]);
-        else if (j > 0 && clean[j-1] != ' ') clean[j++] = ' ';
+int run_benchmarks() {
+    printf("=== TEXTGUARD MICROBENCHMARKS ===\n");
+    printf("Hash family: %s\n", HASH_FAMILY_NAME);
+    printf("\nFingerprintSet (half of the lookups miss):\n");
+    bench_sets(10000);
+    bench_sets(80000);
+    bench_sets(2000000);
+    printf("\nBloom filter (all probes absent):\n");
+    bench_bloom(100000, 0.01);
+    bench_bloom(1000000, 0.01);
+    bench_bloom(1000000, 0.001);
+    bench_bloom(1000000, 0.05);
+    printf("\nBinary fuse filter (all probes absent):\n");
+    bench_fuse(100000);
+    bench_fuse(1000000);
+    printf("\nReference/suspect intersection (hash probing vs sorted merge-join):\n");
+    bench_intersect(10000, 100000, 0.2);
+    bench_intersect(100000, 1000000, 0.2);
+    bench_intersect(1000000, 1000000, 0.5);
+    bench_intersect(1000, 1000000, 0.2);
+    printf("\nCorpus query (serial vs sharded, %d cores):\n", default_shard_count());
+    bench_sharded(2000, 500, 200000);
+    bench_sharded(20000, 200, 500000);
+    printf("\nAll-pairs cohort similarity:\n");
+    bench_all_pairs(500, 2000);
+    bench_all_pairs(5000, 500);
+    printf("\nMinHash + LSH near-duplicate candidates (%d hashes):\n", MINHASH_SIZE);
+    bench_minhash(5000, 500, 0.5, false);
+    bench_minhash(5000, 500, 0.5, true);
+    bench_minhash(50000, 200, 0.5, false);
+    bench_minhash(50000, 200, 0.5, true);
+    bench_minhash(50000, 200, 0.8, true);
+    printf("\nb-bit signatures (query vs every stored signature, %d slots):\n", MINHASH_SIZE);
+    bench_bbit(1000000, 1);
+    bench_bbit(1000000, 2);
+    bench_bbit(1000000, 4);
+    bench_bbit(100000, 64);
+    printf("\nSimHash Hamming index (permuted tables vs linear scan):\n");
+    bench_simhash(100000, 3);
+    bench_simhash(1000000, 3);
+    bench_simhash(1000000, 5);
+    printf("\nPer-comparison allocation (heap vs arena):\n");
+    bench_arena(200, 20000);
+    bench_arena(2000, 2000);
+    bench_arena(50000, 50);
+    return 0;
+}
+#endif
+
+// --- SELF-TESTS ---
+// Built with -DTEXTGUARD_SELFTEST=1; main() then runs these and exits with
+// the number of failed checks. Each one cross-checks a fast path against a
+// plain reference on pseudo-random input; run them under ASan/UBSan and TSan
+// as well as plain -O2.
+
+#if TEXTGUARD_SELFTEST
+static int selftest_failures = 0;
+
+static void selftest_check(bool ok, const char *name) {
+    printf("  %-58s %s\n", name, ok ? "ok" : "FAILED");
+    if (!ok) selftest_failures++;
+}
+
+// Every preprocess kernel the CPU supports against the scalar loop, over
+// random lengths and bytes (ASCII-heavy, with punctuation, whitespace and
+// bytes >= 0x80).
+static void selftest_preprocess(void) {
+    PreprocessKernel kernels[3] = {preprocess_scalar, NULL, NULL};
+    const char *names[3] = {"scalar", "sse4.2", "avx2"};
+#ifdef HAVE_X86_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("popcnt") && __builtin_cpu_supports("sse4.2")) kernels[1] = preprocess_sse42;
+    if (__builtin_cpu_supports("popcnt") && __builtin_cpu_supports("avx2")) kernels[2] = preprocess_avx2;
+    if (kernels[1] || kernels[2]) init_compact_lut();
+#endif
+    static const char alphabet[] = "aZ9 ,.\n\t-_'";
+    char text[600], want[601], got[601];
+    uint64_t state = 3;
+    for (int k = 1; k < 3; k++) {
+        if (!kernels[k]) {
+            printf("  preprocess %-47s skipped (unsupported)\n", names[k]);
+            continue;
+        }
+        bool same = true;
+        for (int round = 0; round < 20000 && same; round++) {
+            size_t len = mix64(state += 0x9E3779B97F4A7C15ULL) % sizeof(text);
+            for (size_t i = 0; i < len; i++) {
+                uint64_t r = mix64(state += 0x9E3779B97F4A7C15ULL);
+                if (r % 8 == 0) text[i] = (char)(0x80 | (r >> 8));         // non-ASCII
+                else if (r % 8 == 1) text[i] = (char)(1 + (r >> 8) % 127);  // any ASCII but NUL
+                else text[i] = alphabet[(r >> 8) % (sizeof(alphabet) - 1)];
+            }
+            size_t nw = kernels[0](text, len, want), ng = kernels[k](text, len, got);
+            same = nw == ng && memcmp(want, got, nw) == 0;
+        }
+        char name[64];
+        snprintf(name, sizeof(name), "preprocess %s matches scalar", names[k]);
+        selftest_check(same, name);
     }
-    clean[j] = '\0';
-    return clean;
 }
 
-int tokenize(char *clean, char words[MAX_WORDS][MAX_WORD_LEN]) {
-    int count = 0;
-    char *token = strtok(clean, " ");
-    while (token && count < MAX_WORDS) {
-        strncpy(words[count++], token, MAX_WORD_LEN - 1);
-        token = strtok(NULL, " ");
+// Random text of words from a vocabulary of the given size; free() it.
+static char* selftest_text(uint64_t *state, int words, int vocab) {
+    char *text = malloc((size_t)words * 8 + 1), *p = text;
+    *p = '\0';
+    for (int i = 0; i < words; i++) {
+        p += sprintf(p, "w%u ", (unsigned)(mix64(*state += 0x9E3779B97F4A7C15ULL) % vocab));
     }
-    return count;
+    return text;
 }
 
-// --- BLOOM FILTER ---
+// Winnowed fingerprints from every kernel (specialized and generic) against
+// the original loop, which took the minimum of every window of w rolling
+// hashes: the same fingerprint set, each selection taken from its own
+// position, and no position emitted twice.
+static void selftest_winnowing(void) {
+    static const int sizes[][2] = {{3, 3}, {4, 4}, {5, 5}, {8, 8}, {2, 7}, {3, 20}, {6, 1}};
+    uint64_t state = 37;
+    Lexicon *lex = create_lexicon();
+    bool same = true;
+    for (int doc = 0; doc < 6; doc++) {
+        char *text = selftest_text(&state, doc == 0 ? 5 : 1500, doc < 3 ? 12 : 400);   // small vocabularies repeat shingles
+        char *clean = preprocess(NULL, text);
+        TokenList tl;
+        int wc = tokenize(NULL, clean, lex, &tl);
+        Fingerprint *hashes = malloc(sizeof(Fingerprint) * (wc + 1));
+        WinnowedFingerprint *win = malloc(sizeof(WinnowedFingerprint) * (wc + 1));
+        for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+            int n = sizes[s][0], w = sizes[s][1];
+            int count = rolling_hashes(&tl, n, hashes), numWin;
+            fingerprint_tokens(&tl, n, w, NULL, win, &numWin);
+            FingerprintSet *want = create_set(NULL), *got = create_set(NULL);
+            for (int i = 0; i + w <= count; i++) {
+                Fingerprint m = hashes[i];
+                for (int j = 1; j < w; j++) if (hashes[i + j].h1 < m.h1) m = hashes[i + j];
+                set_insert(want, m);
+            }
+            for (int i = 0; i < numWin && same; i++) {
+                same = win[i].pos >= 0 && win[i].pos < count && fp_equal(win[i].fp, hashes[win[i].pos])
+                    && (i == 0 || win[i].pos > win[i - 1].pos) && set_contains(want, win[i].fp);
+                set_insert(got, win[i].fp);
+            }
+            same = same && got->size == want->size;
+            free_set(want); free_set(got);
+        }
+        free(hashes); free(win);
+        free_tokens(&tl);
+        free(clean); free(text);
+    }
+    free_lexicon(lex);
+    selftest_check(same, "winnowing matches the windowed-minimum loop");
+}
 
-BloomFilter* create_bloom() {
-    BloomFilter *bf = malloc(sizeof(BloomFilter));
-    bf->size = BLOOM_SIZE;
-    bf->bits = calloc((BLOOM_SIZE / 8) + 1, sizeof(unsigned char));
-    return bf;
+// multi_resolution_scores against one single-n run per size (winnow A into a
+// set, count B's shingles found in it), as menu option 2 would score them.
+static void selftest_multi_resolution(void) {
+    static const int ns[] = {1, 2, 3, 5, 8, 12};
+    enum { NUM = sizeof(ns) / sizeof(ns[0]) };
+    uint64_t state = 41;
+    Lexicon *lex = create_lexicon();
+    Arena *a = create_arena(0);
+    bool same = true;
+    for (int doc = 0; doc < 4; doc++) {
+        char *textA = selftest_text(&state, doc == 0 ? 6 : 2000, 30), *textB = selftest_text(&state, 2000, 30);
+        TokenList tokA, tokB;
+        tokenize(a, preprocess(a, textA), lex, &tokA);
+        int wcB = tokenize(a, preprocess(a, textB), lex, &tokB);
+        for (int w = 1; w <= 17; w += 8) {
+            double scores[NUM];
+            multi_resolution_scores(a, &tokA, &tokB, ns, NUM, w, scores);
+            for (int r = 0; r < NUM; r++) {
+                WinnowedFingerprint *win = mem_alloc(a, sizeof(WinnowedFingerprint) * (tokA.count + 1));
+                Fingerprint *hashes = mem_alloc(a, sizeof(Fingerprint) * (wcB + 1));
+                int numWin, matches = 0;
+                fingerprint_tokens(&tokA, ns[r], w, NULL, win, &numWin);
+                FingerprintSet *fs = create_set(a);
+                for (int i = 0; i < numWin; i++) set_insert(fs, win[i].fp);
+                int count = rolling_hashes(&tokB, ns[r], hashes);
+                for (int i = 0; i < count; i++) matches += set_contains(fs, hashes[i]);
+                double want = fs->size ? (double)matches / fs->size * 100.0 : 0.0;
+                same = same && scores[r] == want;
+            }
+        }
+        arena_reset(a);
+        free(textA); free(textB);
+    }
+    free_arena(a); free_lexicon(lex);
+    selftest_check(same, "multi-resolution scores match single-n runs");
 }
 
-void bloom_add(BloomFilter *bf, Fingerprint f) {
-    int idx1 = abs((int)(f.h1 % bf->size));
-    int idx2 = abs((int)(f.h2 % bf->size));
-    bf->bits[idx1/8] |= (1 << (idx1%8));
-    bf->bits[idx2/8] |= (1 << (idx2%8));
+static TieBreak selftest_tie;
+
+static int selftest_rank_compare(const void *a, const void *b) {
+    const FreqEntry *x = a, *y = b;
+    return rank_above(x, y, selftest_tie) ? -1 : rank_above(y, x, selftest_tie) ? 1 : 0;
 }
 
-bool bloom_check(BloomFilter *bf, Fingerprint f) {
-    int idx1 = abs((int)(f.h1 % bf->size));
-    int idx2 = abs((int)(f.h2 % bf->size));
-    if (!(bf->bits[idx1/8] & (1 << (idx1%8)))) return false;
-    if (!(bf->bits[idx2/8] & (1 << (idx2%8)))) return false;
-    return true;
+// The incremental top-K heap against a full sort of exact counts, over
+// uniform (close races at the K boundary) and skewed random update streams,
+// for several K and both tie-breaks.
+static void selftest_topk(void) {
+    enum { UNIVERSE = 3000, UPDATES = 50000 };
+    FreqEntry *ref = malloc(sizeof(FreqEntry) * UNIVERSE);
+    FreqEntry top[64];
+    uint64_t state = 7;
+    bool same = true;
+    for (int run = 0; run < 4; run++) {
+        int tie = run % 2, universe = run < 2 ? 300 : UNIVERSE;
+        for (int k = 1; k <= 64; k *= 4) {
+            selftest_tie = (TieBreak)tie;
+            FrequencyMap *fm = create_freq_map(NULL, k, (TieBreak)tie);
+            for (int j = 0; j < UNIVERSE; j++) ref[j] = (FreqEntry){0, -1, 5 + j % 7, -1};
+            for (int i = 0; i < UPDATES; i++) {
+                uint64_t r = mix64(state += 0x9E3779B97F4A7C15ULL);
+                int j = (int)(r % universe);
+                if (universe == UNIVERSE) j >>= (int)((r >> 32) % 8);   // skewed towards small ids
+                freq_update(fm, fp_const(j + 1), i, ref[j].phraseLen);
+                if (ref[j].frequency++ == 0) ref[j].firstPos = i;
+            }
+            qsort(ref, UNIVERSE, sizeof(FreqEntry), selftest_rank_compare);
+            int n = freq_top(fm, top);
+            same = same && n == k;
+            for (int i = 0; i < n && same; i++) {
+                same = top[i].frequency == ref[i].frequency && top[i].firstPos == ref[i].firstPos
+                    && top[i].phraseLen == ref[i].phraseLen;
+            }
+            free_freq_map(fm);
+        }
+    }
+    free(ref);
+    selftest_check(same, "top-K heap matches a full sort (K = 1..64, both ties)");
 }
 
-// --- HASH SETS & FREQUENCY MAP ---
+// The fingerprint table against a plain membership array over cycles of
+// filling 1024 slots to their load limit (896 keys) and erasing every key.
+// The first insert of the refill then finds the table full of tombstones
+// with nothing live, which must be cleaned by rehashing in place rather than
+// by growing.
+static void selftest_table(void) {
+    enum { UNIVERSE = 4000, CYCLES = 40 };
+    bool *in = calloc(UNIVERSE, sizeof(bool));
+    FpTable *t = create_table(NULL, sizeof(uint32_t), 0);
+    uint64_t state = 23;
+    size_t live = 0, maxCapacity = 0;
+    bool same = true;
+    for (int cycle = 0; cycle < CYCLES && same; cycle++) {
+        while (live < 896 && same) {
+            int j = (int)(mix64(state += 0x9E3779B97F4A7C15ULL) % UNIVERSE);
+            bool inserted;
+            *(uint32_t *)table_value(t, table_insert(t, fp_const(j + 1), &inserted)) = (uint32_t)j;
+            same = inserted == !in[j];
+            if (!in[j]) live++;
+            in[j] = true;
+            if (t->capacity > maxCapacity) maxCapacity = t->capacity;
+        }
+        while (live > 0 && same) {
+            int j = (int)(mix64(state += 0x9E3779B97F4A7C15ULL) % UNIVERSE);
+            same = table_erase(t, fp_const(j + 1)) == in[j];
+            if (in[j]) live--;
+            in[j] = false;
+        }
+        for (int v = 0; v < UNIVERSE && same; v++) {
+            long slot = table_find(t, fp_const(v + 1));
+            same = (slot >= 0) == in[v] && (slot < 0 || *(uint32_t *)table_value(t, slot) == (uint32_t)v);
+        }
+    }
+    selftest_check(same && t->size == live, "table insert/erase matches a membership array");
+    selftest_check(maxCapacity == 1024, "table cleans tombstones in place");
+    free_table(t);
+    free(in);
+}
 
-FingerprintSet* create_set() {
-    FingerprintSet *fs = malloc(sizeof(FingerprintSet));
-    fs->capacity = TABLE_SIZE;
-    fs->items = malloc(sizeof(Fingerprint) * TABLE_SIZE);
-    fs->occupied = calloc(TABLE_SIZE, sizeof(bool));
-    fs->size = 0;
-    return fs;
+// The Space-Saving sketch against exact counts on skewed streams: every
+// counter lies between the true count and the true count plus total / m,
+// and every item seen more than total / m times is monitored.
+static void selftest_space_saving(void) {
+    enum { UNIVERSE = 5000, UPDATES = 100000 };
+    int *exact = malloc(sizeof(int) * UNIVERSE);
+    uint64_t state = 29;
+    bool bounds = true, heavy = true, index = true;
+    for (int m = 16; m <= 256; m *= 4) {
+        memset(exact, 0, sizeof(int) * UNIVERSE);
+        SpaceSaving *ss = create_space_saving(NULL, 8, m, TIE_FIRST_POSITION);
+        for (int i = 0; i < UPDATES; i++) {
+            uint64_t r = mix64(state += 0x9E3779B97F4A7C15ULL);
+            int j = (int)(r % UNIVERSE >> (r >> 32) % 12);
+            ss_update(ss, fp_const(j + 1), i, 3);
+            exact[j]++;
+        }
+        long long bound = ss_error_bound(ss);
+        bounds = bounds && bound == UPDATES / m;
+        index = index && ss->count == m && ss->index->size == (size_t)m;
+        for (int j = 0; j < UNIVERSE; j++) {
+            long slot = table_find(ss->index, fp_const(j + 1));
+            if (slot < 0) {
+                heavy = heavy && exact[j] <= bound;
+                continue;
+            }
+            int c = (int)*(uint32_t *)table_value(ss->index, slot);
+            int f = ss->entries[c].frequency;
+            index = index && fp_equal(ss->fps[c], fp_const(j + 1));
+            bounds = bounds && exact[j] <= f && f <= exact[j] + bound && f - ss->error[c] <= exact[j];
+        }
+        free_space_saving(ss);
+    }
+    free(exact);
+    selftest_check(index, "space-saving index maps every counter");
+    selftest_check(bounds, "space-saving counts within [true, true + total/m]");
+    selftest_check(heavy, "space-saving monitors every item above total/m");
 }
 
-void set_insert(FingerprintSet *fs, Fingerprint f) {
-    int idx = abs((int)(f.h1 % fs->capacity));
-    while (fs->occupied[idx]) {
-        if (fs->items[idx].h1 == f.h1 && fs->items[idx].h2 == f.h2) return;
-        idx = (idx + 1) % fs->capacity;
+// The binary fuse filter over every set size from 0 to 100 and then in
+// steps up to 3000 keys: it must build, accept every inserted key, and
+// reject nearly all others (8-bit tags: about 0.4% false positives).
+static void selftest_fuse(void) {
+    uint64_t state = 43;
+    bool built = true, inserted = true;
+    long probes = 0, positives = 0;
+    for (int size = 0; size <= 3000; size += size < 100 ? 1 : 97) {
+        FingerprintSet *fs = create_set(NULL);
+        Fingerprint *keys = malloc(sizeof(Fingerprint) * (size + 1));
+        for (int i = 0; i < size; i++) {
+            keys[i] = fp_const((long long)(mix64(state += 0x9E3779B97F4A7C15ULL) >> 4));
+            set_insert(fs, keys[i]);
+        }
+        FuseFilter *ff = fuse_filter_from_set(NULL, fs);
+        built = built && ff != NULL;
+        for (int i = 0; ff && i < size; i++) inserted = inserted && fuse_check(ff, keys[i]);
+        for (int i = 0; ff && size > 0 && i < 200; i++) {
+            Fingerprint f = fp_const((long long)(mix64(state += 0x9E3779B97F4A7C15ULL) >> 4));
+            if (!set_contains(fs, f)) {
+                probes++;
+                positives += fuse_check(ff, f);
+            }
+        }
+        free_fuse_filter(ff);
+        free(keys);
+        free_set(fs);
     }
-    fs->items[idx] = f;
-    fs->occupied[idx] = true;
-    fs->size++;
+    selftest_check(built && inserted, "fuse filter accepts every key (0 to 3000 keys)");
+    selftest_check(positives * 100 < probes, "fuse filter false-positive rate under 1%");
 }
 
-bool set_contains(FingerprintSet *fs, Fingerprint f) {
-    int idx = abs((int)(f.h1 % fs->capacity));
-    while (fs->occupied[idx]) {
-        if (fs->items[idx].h1 == f.h1 && fs->items[idx].h2 == f.h2) return true;
-        idx = (idx + 1) % fs->capacity;
+// The merge-join scan against the hashing scan on the same documents: the
+// match count and the whole top-K tally (with the exact map or the
+// Space-Saving sketch, whichever this build ranks with) must agree.
+static void selftest_merge_scan(void) {
+    enum { WORDS = 4000 };
+    uint64_t state = 31;
+    char *docA = malloc(WORDS * 8 + 1), *docB = malloc(WORDS * 8 + 1);
+    char *pa = docA, *pb = docB;
+    for (int i = 0; i < WORDS; i++) {
+        uint64_t r = mix64(state += 0x9E3779B97F4A7C15ULL);
+        pa += sprintf(pa, "w%u ", (unsigned)(r % 60));
     }
-    return false;
+    for (int i = 0; i < WORDS; i += 8) {   // runs of 8 words, half copied from A
+        uint64_t r = mix64(state += 0x9E3779B97F4A7C15ULL);
+        if (r % 2) {
+            const char *from = docA;
+            for (uint64_t skip = (r >> 8) % (WORDS - 8); skip > 0; skip--) from = strchr(from, ' ') + 1;
+            const char *to = from;
+            for (int k = 0; k < 8; k++) to = strchr(to, ' ') + 1;
+            memcpy(pb, from, to - from);
+            pb += to - from;
+        } else {
+            for (int k = 0; k < 8; k++) pb += sprintf(pb, "w%u ", (unsigned)(mix64(r + k) % 60));
+        }
+    }
+    *pb = '\0';
+    Lexicon *lex = create_lexicon();
+    Arena *a = create_arena(0);
+    bool same = true;
+    for (int n = 3; n <= 5; n += 2) {
+        for (int k = 5; k <= 20; k += 15) {
+            for (int tie = 0; tie < 2; tie++) {
+                TokenList tokA, tokB;
+                int wcA = tokenize(a, preprocess(a, docA), lex, &tokA);
+                int wcB = tokenize(a, preprocess(a, docB), lex, &tokB);
+                WinnowedFingerprint *winA = mem_alloc(a, sizeof(WinnowedFingerprint) * (wcA + 1));
+                int numWinA;
+                fingerprint_tokens(&tokA, n, 3, NULL, winA, &numWinA);
+                Fingerprint *hashesB = mem_alloc(a, sizeof(Fingerprint) * (wcB + 1));
+                int numHashesB = rolling_hashes(&tokB, n, hashesB);
+
+                FingerprintSet *fs = create_set(a);
+                for (int i = 0; i < numWinA; i++) set_insert(fs, winA[i].fp);
+#if USE_FUSE_FILTER
+                Gatekeeper *gate = fuse_filter_from_set(a, fs);
+#else
+                Gatekeeper *gate = create_bloom(a, numWinA, BLOOM_FPR);
+                for (int i = 0; i < numWinA; i++) bloom_add(gate, winA[i].fp);
+#endif
+                PhraseTally *hashTally = tally_create(a, k, (TieBreak)tie);
+                int hashMatches = scan_suspect(hashesB, numHashesB, &tokB, n, gate, fs, hashTally);
+
+                uint64_t *keysA = mem_alloc(a, sizeof(uint64_t) * (numWinA + 1));
+                int refSize = sorted_keys(a, winA, numWinA, keysA);
+                PhraseTally *mergeTally = tally_create(a, k, (TieBreak)tie);
+                int mergeMatches = merge_scan_suspect(a, hashesB, numHashesB, &tokB, n, keysA, refSize, mergeTally);
+
+                FreqEntry hashTop[20], mergeTop[20];
+                int nh = tally_top(hashTally, hashTop), nm = tally_top(mergeTally, mergeTop);
+                same = same && refSize == (int)fs->size && hashMatches == mergeMatches && nh == nm;
+                for (int i = 0; i < nh && same; i++) {
+                    same = hashTop[i].frequency == mergeTop[i].frequency && hashTop[i].firstPos == mergeTop[i].firstPos
+                        && hashTop[i].phraseLen == mergeTop[i].phraseLen;
+                }
+                arena_reset(a);
+            }
+        }
+    }
+    selftest_check(same, "merge-join scan tally matches the hashing scan");
+    free_arena(a); free_lexicon(lex);
+    free(docA); free(docB);
 }
 
-FrequencyMap* create_freq_map() {
-    FrequencyMap *fm = malloc(sizeof(FrequencyMap));
-    fm->capacity = TABLE_SIZE;
-    fm->table = calloc(TABLE_SIZE, sizeof(FreqEntry));
-    return fm;
+// Readers pin snapshots and query while the main thread adds, commits and
+// removes with the background compactor running. Every hit a reader sees
+// must carry the match count the document has in a plain index of all
+// documents, and must not be a document removed before the pin. After every
+// round, and after a final full compaction, a full query must equal that
+// index with the removed and not yet added documents masked out.
+enum { ST_DOCS = 400, ST_DOC_FPS = 50, ST_QUERY = 300, ST_UNIVERSE = 2000, ST_READERS = 3 };
+
+typedef struct {
+    Corpus *c;
+    const Fingerprint *query;
+    const int *expected;
+    int *gone;                  // set once corpus_remove has returned
+    int stop;
+    int bad;
+} SelftestCorpusShared;
+
+static void* selftest_corpus_reader(void *arg) {
+    SelftestCorpusShared *sh = arg;
+    DocHit hits[16];
+    bool gone[ST_DOCS];
+    while (!__atomic_load_n(&sh->stop, __ATOMIC_ACQUIRE)) {
+        for (int d = 0; d < ST_DOCS; d++) gone[d] = __atomic_load_n(&sh->gone[d], __ATOMIC_ACQUIRE);
+        CorpusSnapshot *snap = corpus_snapshot(sh->c);
+        int n = corpus_query(snap, sh->query, ST_QUERY, 16, hits);
+        for (int i = 0; i < n; i++) {
+            if (hits[i].doc < 0 || hits[i].doc >= ST_DOCS || hits[i].matches != sh->expected[hits[i].doc]
+                || gone[hits[i].doc]
+                || (i > 0 && doc_hit_compare(&hits[i - 1], &hits[i]) > 0)) {
+                __atomic_fetch_add(&sh->bad, 1, __ATOMIC_RELAXED);
+            }
+        }
+        corpus_release(sh->c, snap);
+    }
+    return NULL;
+}
+
+static bool selftest_corpus_matches(Corpus *c, InvertedIndex *ref, const Fingerprint *query,
+                                    const uint8_t *mask, int live, DocHit *want, DocHit *got) {
+    CorpusSnapshot *snap = corpus_snapshot(c);
+    int have = 0;
+    for (int i = 0; i < snap->numSegs; i++) have += snap->segs[i]->idx->numDocs - (snap->dead[i] ? snap->dead[i]->count : 0);
+    int numWant = index_query(ref, mask, query, ST_QUERY, ST_DOCS, want);
+    int numGot = corpus_query(snap, query, ST_QUERY, ST_DOCS, got);
+    corpus_release(c, snap);
+    bool same = have == live && numGot == numWant;
+    for (int i = 0; i < numGot && same; i++) {
+        same = got[i].doc == want[i].doc && got[i].matches == want[i].matches
+            && got[i].firstSuspectPos == want[i].firstSuspectPos && got[i].firstRefPos == want[i].firstRefPos;
+    }
+    return same;
 }
 
-void freq_update(FrequencyMap *fm, Fingerprint f, char *phrase) {
-    int idx = abs((int)(f.h1 % fm->capacity));
-    while (fm->table[idx].occupied) {
-        if (fm->table[idx].fp.h1 == f.h1 && fm->table[idx].fp.h2 == f.h2) {
-            fm->table[idx].frequency++;
-            return;
+static void selftest_corpus(void) {
+    WinnowedFingerprint (*docs)[ST_DOC_FPS] = malloc(sizeof(*docs) * ST_DOCS);
+    Fingerprint query[ST_QUERY];
+    uint64_t state = 11;
+    InvertedIndex *ref = create_index();
+    for (int d = 0; d < ST_DOCS; d++) {
+        for (int i = 0; i < ST_DOC_FPS; i++) {
+            docs[d][i] = (WinnowedFingerprint){fp_const(mix64(state += 0x9E3779B97F4A7C15ULL) % ST_UNIVERSE + 1), i};
+        }
+        index_add_document(ref, NULL, "doc", docs[d], ST_DOC_FPS);
+    }
+    index_finalize(ref);
+    for (int i = 0; i < ST_QUERY; i++) query[i] = fp_const(mix64(state += 0x9E3779B97F4A7C15ULL) % ST_UNIVERSE + 1);
+
+    DocHit *want = malloc(sizeof(DocHit) * ST_DOCS), *got = malloc(sizeof(DocHit) * ST_DOCS);
+    int expected[ST_DOCS] = {0};
+    int numWant = index_query(ref, NULL, query, ST_QUERY, ST_DOCS, want);
+    for (int i = 0; i < numWant; i++) expected[want[i].doc] = want[i].matches;
+
+    int gone[ST_DOCS] = {0};
+    SelftestCorpusShared sh = {create_corpus(), query, expected, gone, 0, 0};
+    corpus_start_compactor(sh.c);
+    pthread_t readers[ST_READERS];
+    for (int t = 0; t < ST_READERS; t++) pthread_create(&readers[t], NULL, selftest_corpus_reader, &sh);
+
+    uint8_t removed[(ST_DOCS + 7) / 8] = {0}, mask[(ST_DOCS + 7) / 8];
+    int numRemoved = 0;
+    bool ids = true, rounds = true;
+    for (int d = 0; d < ST_DOCS; d += 10) {
+        for (int j = d; j < d + 10; j++) ids = ids && corpus_add_document(sh.c, NULL, "doc", docs[j], ST_DOC_FPS) == (uint32_t)j;
+        corpus_commit(sh.c);
+        for (int r = 0; r < 3; r++) {
+            int victim = (int)(mix64(state += 0x9E3779B97F4A7C15ULL) % (uint64_t)(d + 10));
+            bool was = removed[victim >> 3] >> (victim & 7) & 1;
+            if (corpus_remove(sh.c, (uint32_t)victim) == was) ids = false;
+            if (!was) numRemoved++;
+            removed[victim >> 3] |= (uint8_t)(1 << (victim & 7));
+            __atomic_store_n(&gone[victim], 1, __ATOMIC_RELEASE);
         }
-        idx = (idx + 1) % fm->capacity;
+        memcpy(mask, removed, sizeof(mask));
+        for (int j = d + 10; j < ST_DOCS; j++) mask[j >> 3] |= (uint8_t)(1 << (j & 7));
+        rounds = rounds && selftest_corpus_matches(sh.c, ref, query, mask, d + 10 - numRemoved, want, got);
     }
-    fm->table[idx].fp = f;
-    fm->table[idx].frequency = 1;
-    strncpy(fm->table[idx].phrase, phrase, sizeof(fm->table[idx].phrase) - 1);
-    fm->table[idx].occupied = true;
+    __atomic_store_n(&sh.stop, 1, __ATOMIC_RELEASE);
+    for (int t = 0; t < ST_READERS; t++) pthread_join(readers[t], NULL);
+    selftest_check(ids, "corpus ids and removals as staged");
+    selftest_check(sh.bad == 0, "corpus readers see consistent hits during updates");
+    selftest_check(rounds, "corpus matches a plain index after every round");
+    corpus_compact(sh.c, true);
+    selftest_check(selftest_corpus_matches(sh.c, ref, query, removed, ST_DOCS - numRemoved, want, got),
+                   "corpus matches a plain index after full compaction");
+
+    free_corpus(sh.c);
+    free_index(ref);
+    free(want); free(got); free(docs);
 }
 
-// --- HEAP RANKING LOGIC ---
+// sharded_query against index_query for 1..16 shards and several K, over an
+// in-memory index and the same index saved and mapped back in.
+static void selftest_sharded(void) {
+    enum { DOCS = 300, DOC_FPS = 40, QUERY = 200, UNIVERSE = 3000 };
+    WinnowedFingerprint win[DOC_FPS];
+    Fingerprint query[QUERY];
+    uint64_t state = 13;
+    InvertedIndex *idx = create_index();
+    for (int d = 0; d < DOCS; d++) {
+        for (int i = 0; i < DOC_FPS; i++) {
+            uint64_t r = mix64(state += 0x9E3779B97F4A7C15ULL);
+            win[i] = (WinnowedFingerprint){fp_const((r % UNIVERSE >> (r >> 32) % 6) + 1), i};
+        }
+        index_add_document(idx, NULL, "doc", win, DOC_FPS);
+    }
+    char path[64];
+    snprintf(path, sizeof(path), "/tmp/textguard_selftest_%d.idx", (int)getpid());
+    int n, w;
+    bool saved = index_save(idx, path, 3, 4);
+    InvertedIndex *mapped = saved ? open_index(path, &n, &w) : NULL;
+    unlink(path);
+    selftest_check(mapped != NULL, "index saves and maps back");
+
+    DocHit *want = malloc(sizeof(DocHit) * DOCS), *got = malloc(sizeof(DocHit) * DOCS);
+    static const int ks[] = {1, 10, DOCS};
+    bool same = true;
+    for (int m = 0; m < (mapped ? 2 : 1); m++) {
+        InvertedIndex *src = m ? mapped : idx;
+        for (int shards = 1; shards <= 16; shards++) {
+            ShardedIndex *si = create_sharded_index(src, shards);
+            for (int q = 0; q < 4; q++) {
+                for (int i = 0; i < QUERY; i++) {
+                    uint64_t r = mix64(state += 0x9E3779B97F4A7C15ULL);
+                    query[i] = fp_const((r % UNIVERSE >> (r >> 32) % 6) + 1);
+                }
+                for (size_t j = 0; j < sizeof(ks) / sizeof(ks[0]); j++) {
+                    int nw = index_query(src, NULL, query, QUERY, ks[j], want);
+                    int ng = sharded_query(si, query, QUERY, ks[j], got);
+                    same = same && nw == ng;
+                    for (int i = 0; i < ng && same; i++) {
+                        same = got[i].doc == want[i].doc && got[i].matches == want[i].matches
+                            && got[i].score == want[i].score && got[i].firstSuspectPos == want[i].firstSuspectPos
+                            && got[i].firstRefPos == want[i].firstRefPos;
+                    }
+                }
+            }
+            free_sharded_index(si);
+        }
+    }
+    selftest_check(same, "sharded query matches serial (1..16 shards, mapped too)");
+    free(want); free(got);
+    free_index(mapped);
+    free_index(idx);
+}
 
-void swap(FreqEntry *a, FreqEntry *b) {
-    FreqEntry temp = *a;
-    *a = *b;
-    *b = temp;
+static int selftest_u32_compare(const void *a, const void *b) {
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+    return x < y ? -1 : x > y;
 }
 
-void min_heapify(FreqEntry heap[], int n, int i) {
-    int smallest = i;
-    int l = 2 * i + 1;
-    int r = 2 * i + 2;
-    if (l < n && heap[l].frequency < heap[smallest].frequency) smallest = l;
-    if (r < n && heap[r].frequency < heap[smallest].frequency) smallest = r;
-    if (smallest != i) {
-        swap(&heap[i], &heap[smallest]);
-        min_heapify(heap, n, smallest);
+// all_pairs_similarity against a brute-force count of the distinct
+// fingerprints every pair shares, for 1, 2 and 4 threads.
+static void selftest_all_pairs(void) {
+    enum { DOCS = 200, DOC_FPS = 30, UNIVERSE = 1500 };
+    uint32_t (*vals)[DOC_FPS] = malloc(sizeof(*vals) * DOCS);
+    int distinct[DOCS];
+    WinnowedFingerprint win[DOC_FPS];
+    uint64_t state = 17;
+    InvertedIndex *idx = create_index();
+    for (int d = 0; d < DOCS; d++) {
+        for (int i = 0; i < DOC_FPS; i++) {
+            uint64_t r = mix64(state += 0x9E3779B97F4A7C15ULL);
+            vals[d][i] = (uint32_t)(r % UNIVERSE >> (r >> 32) % 5) + 1;   // skewed, with repeats
+            win[i] = (WinnowedFingerprint){fp_const(vals[d][i]), i};
+        }
+        index_add_document(idx, NULL, "doc", win, DOC_FPS);
+        qsort(vals[d], DOC_FPS, sizeof(uint32_t), selftest_u32_compare);
+        distinct[d] = 0;
+        for (int i = 0; i < DOC_FPS; i++) {
+            if (i == 0 || vals[d][i] != vals[d][i - 1]) vals[d][distinct[d]++] = vals[d][i];
+        }
+    }
+
+    bool same = true;
+    for (int minShared = 1; minShared <= 3; minShared += 2) {
+        // Brute-force pairs in (a, b) order, as all_pairs_similarity sorts them.
+        size_t cap = 1024, numWant = 0;
+        PairSimilarity *want = malloc(sizeof(PairSimilarity) * cap);
+        for (int a = 0; a < DOCS; a++) {
+            for (int b = a + 1; b < DOCS; b++) {
+                int common = 0;
+                for (int i = 0, j = 0; i < distinct[a] && j < distinct[b];) {
+                    if (vals[a][i] == vals[b][j]) { common++; i++; j++; }
+                    else if (vals[a][i] < vals[b][j]) i++;
+                    else j++;
+                }
+                if (common < minShared) continue;
+                if (numWant == cap) want = realloc(want, sizeof(PairSimilarity) * (cap *= 2));
+                int uni = distinct[a] + distinct[b] - common;
+                want[numWant++] = (PairSimilarity){(uint32_t)a, (uint32_t)b, (uint32_t)common, (float)common / uni};
+            }
+        }
+        for (int threads = 1; threads <= 4; threads *= 2) {
+            SimilarityMatrix *m = all_pairs_similarity(idx, minShared, 0, threads);
+            same = same && m->numDocs == DOCS && m->count == numWant;
+            for (size_t i = 0; i < m->count && same; i++) {
+                same = m->pairs[i].a == want[i].a && m->pairs[i].b == want[i].b
+                    && m->pairs[i].shared == want[i].shared && m->pairs[i].jaccard == want[i].jaccard;
+            }
+            free_similarity_matrix(m);
+        }
+        free(want);
     }
+    selftest_check(same, "all-pairs matches brute force (1, 2 and 4 threads)");
+    free_index(idx);
+    free(vals);
 }
 
-// --- CORE LOGIC ---
+// LSH banding over a mix of empty signatures (documents shorter than n
+// words) and pairs of near copies, in both MinHash modes: every near-copy
+// pair must come back, and no pair may involve an empty signature.
+static void selftest_lsh(void) {
+    enum { EMPTY = 10, PAIRS = 10, DOCS = EMPTY + 2 * PAIRS, SHINGLES = 200 };
+    uint64_t *sigs = malloc(sizeof(uint64_t) * MINHASH_SIZE * DOCS);
+    Fingerprint shingles[SHINGLES];
+    uint64_t state = 53;
+    bool found = true, empty = true;
+    for (int oph = 0; oph < 2; oph++) {
+        MinHasher *mh = create_minhasher(MINHASH_SIZE, 1, oph);
+        for (int d = 0; d < EMPTY; d++) minhash_signature(mh, shingles, 0, sigs + (size_t)d * MINHASH_SIZE);
+        for (int p = 0; p < PAIRS; p++) {
+            for (int i = 0; i < SHINGLES; i++) shingles[i] = fp_const((long long)(mix64(state += 0x9E3779B97F4A7C15ULL) >> 4));
+            minhash_signature(mh, shingles, SHINGLES, sigs + (size_t)(EMPTY + 2 * p) * MINHASH_SIZE);
+            for (int i = 0; i < SHINGLES / 10; i++) shingles[i] = fp_const((long long)(mix64(state += 0x9E3779B97F4A7C15ULL) >> 4));
+            minhash_signature(mh, shingles, SHINGLES, sigs + (size_t)(EMPTY + 2 * p + 1) * MINHASH_SIZE);
+        }
+        int bands, rows;
+        lsh_choose_bands(MINHASH_SIZE, 0.5, &bands, &rows);
+        CandidatePair *cand;
+        size_t count = lsh_candidates(sigs, DOCS, MINHASH_SIZE, bands, rows, 0.5, &cand);
+        for (size_t i = 0; i < count; i++) empty = empty && cand[i].a >= EMPTY && cand[i].b >= EMPTY;
+        for (int p = 0; p < PAIRS; p++) {
+            bool hit = false;
+            for (size_t i = 0; i < count; i++) hit = hit || (cand[i].a == (uint32_t)(EMPTY + 2 * p) && cand[i].b == cand[i].a + 1);
+            found = found && hit;
+        }
+        free(cand);
+        free_minhasher(mh);
+    }
+    free(sigs);
+    selftest_check(found, "lsh finds every near-copy pair (both MinHash modes)");
+    selftest_check(empty, "lsh never pairs empty signatures");
+}
 
-Fingerprint get_double_hash(char words[][MAX_WORD_LEN], int start, int n) {
-    long long h1 = 0, h2 = 0;
-    for (int i = 0; i < n; i++) {
-        for (int j = 0; words[start + i][j]; j++) {
-            h1 = (h1 * BASE + words[start + i][j]) % MOD1;
-            h2 = (h2 * BASE + words[start + i][j]) % MOD2;
+static int selftest_match_compare(const void *a, const void *b) {
+    const SimHashMatch *x = a, *y = b;
+    return x->id < y->id ? -1 : x->id > y->id;
+}
+
+// The permuted-table SimHash index against a linear scan for every radius
+// from 0 to 7: the same ids at the same distances, each reported once. The
+// entries come in clusters of near copies (and exact duplicates), and the
+// queries are entries with up to radius + 2 bits flipped.
+static void selftest_simhash(void) {
+    enum { ENTRIES = 4000, QUERIES = 300 };
+    uint64_t *hashes = malloc(sizeof(uint64_t) * ENTRIES);
+    SimHashMatch *want = malloc(sizeof(SimHashMatch) * ENTRIES), *got = malloc(sizeof(SimHashMatch) * ENTRIES);
+    uint64_t state = 47;
+    for (int i = 0; i < ENTRIES; i++) {
+        uint64_t r = mix64(state += 0x9E3779B97F4A7C15ULL);
+        hashes[i] = i > 0 && r % 4 ? hashes[(r >> 8) % i] : r;
+        for (int f = (int)((r >> 40) % 6); f > 0; f--) hashes[i] ^= 1ULL << (mix64(state += 1) % 64);
+    }
+    bool same = true;
+    for (int radius = 0; radius < SIMHASH_MAX_TABLES; radius++) {
+        SimHashIndex *idx = create_simhash_index(radius);
+        for (int i = 0; i < ENTRIES; i++) simhash_index_add(idx, hashes[i], (uint32_t)i);
+        simhash_index_build(idx);
+        for (int q = 0; q < QUERIES && same; q++) {
+            uint64_t r = mix64(state += 0x9E3779B97F4A7C15ULL), h = hashes[r % ENTRIES];
+            for (int f = (int)((r >> 32) % (radius + 3)); f > 0; f--) h ^= 1ULL << (mix64(state += 1) % 64);
+            int numWant = 0;
+            for (int i = 0; i < ENTRIES; i++) {
+                int d = __builtin_popcountll(hashes[i] ^ h);
+                if (d <= radius) want[numWant++] = (SimHashMatch){(uint32_t)i, d};
+            }
+            int numGot = simhash_index_query(idx, h, got, ENTRIES);
+            qsort(got, numGot, sizeof(SimHashMatch), selftest_match_compare);
+            same = numGot == numWant;
+            for (int i = 0; i < numGot && same; i++) same = got[i].id == want[i].id && got[i].distance == want[i].distance;
+        }
+        free_simhash_index(idx);
+    }
+    selftest_check(same, "simhash index matches a linear scan (radius 0..7)");
+    free(hashes); free(want); free(got);
+}
+
+// A warm arena must serve a whole comparison (tokenize, fingerprinting on
+// the specialized and the generic winnower, set + Bloom filter, tally, top-K
+// and multi-resolution scoring) without a single heap call.
+static void selftest_arena(void) {
+    enum { WORDS = 2000, ROUNDS = 3 };
+    uint64_t state = 19;
+    char *docA = malloc(WORDS * 8 + 1), *docB = malloc(WORDS * 8 + 1);
+    char *pa = docA, *pb = docB;
+    for (int i = 0; i < WORDS; i++) {
+        uint64_t r = mix64(state += 0x9E3779B97F4A7C15ULL);
+        pa += sprintf(pa, "w%u ", (unsigned)(r % 5000));
+        pb += sprintf(pb, "w%u ", (unsigned)(r % 3 ? r % 5000 : (r >> 32) % 5000));
+    }
+    Lexicon *lex = create_lexicon();
+    Arena *a = create_arena(0);
+    static const int ns[] = {3, 5, 8};
+    double scores[3];
+    FreqEntry top[TOP_K];
+    long heapCalls = 0;
+    for (int round = 0; round <= ROUNDS; round++) {
+        long before = __atomic_load_n(&selftest_heap_calls, __ATOMIC_RELAXED);
+        char *cleanA = preprocess(a, docA), *cleanB = preprocess(a, docB);
+        TokenList tokA, tokB;
+        int wcA = tokenize(a, cleanA, lex, &tokA), wcB = tokenize(a, cleanB, lex, &tokB);
+        WinnowedFingerprint *winA = mem_alloc(a, sizeof(WinnowedFingerprint) * (wcA + 1));
+        int numWinA;
+        fingerprint_tokens(&tokA, 3, 20, NULL, winA, &numWinA);
+        fingerprint_tokens(&tokA, 3, 3, NULL, winA, &numWinA);
+        FingerprintSet *fs = create_set(a);
+        BloomFilter *bf = create_bloom(a, numWinA, BLOOM_FPR);
+        for (int i = 0; i < numWinA; i++) {
+            set_insert(fs, winA[i].fp);
+            bloom_add(bf, winA[i].fp);
         }
-        if (i < n - 1) { h1 = (h1 * BASE + ' ') % MOD1; h2 = (h2 * BASE + ' ') % MOD2; }
+        Fingerprint *hashesB = mem_alloc(a, sizeof(Fingerprint) * (wcB + 1));
+        int numHashesB = rolling_hashes(&tokB, 3, hashesB);
+        PhraseTally *tally = tally_create(a, TOP_K, TIE_FIRST_POSITION);
+        for (int i = 0; i < numHashesB; i++) {
+            if (bloom_check(bf, hashesB[i]) && set_contains(fs, hashesB[i])) tally_update(tally, hashesB[i], i, 0);
+        }
+        tally_top(tally, top);
+        multi_resolution_scores(a, &tokA, &tokB, ns, 3, 4, scores);
+        arena_reset(a);
+        if (round > 0) heapCalls += __atomic_load_n(&selftest_heap_calls, __ATOMIC_RELAXED) - before;
     }
-    return (Fingerprint){h1, h2};
+    selftest_check(heapCalls == 0, "warm arena comparison makes no heap calls");
+    free_arena(a); free_lexicon(lex);
+    free(docA); free(docB);
+}
+
+int run_selftests() {
+    printf("=== TEXTGUARD SELF-TESTS ===\n");
+    printf("Hash family: %s\n", HASH_FAMILY_NAME);
+    selftest_preprocess();
+    selftest_winnowing();
+    selftest_multi_resolution();
+    selftest_topk();
+    selftest_table();
+    selftest_space_saving();
+    selftest_fuse();
+    selftest_merge_scan();
+    selftest_corpus();
+    selftest_sharded();
+    selftest_all_pairs();
+    selftest_lsh();
+    selftest_simhash();
+    selftest_arena();
+    printf("%d failed\n", selftest_failures);
+    return selftest_failures;
 }
+#endif
 
 int main() {
+#if TEXTGUARD_BENCH
+    return run_benchmarks();
+#endif
+#if TEXTGUARD_SELFTEST
+    return run_selftests();
+#endif
     char *docA = NULL, *docB = NULL;
     char buffer[MAX_TEXT];
     int choice;
@@ -214,10 +4691,433 @@ int main() {
     printf("Select Input Mode:\n");
     printf("1. Manual Text Entry\n");
     printf("2. Read from .txt Files\n");
+    printf("3. Multi-Resolution Scan (.txt Files)\n");
+    printf("4. Corpus Scan (many references, .txt Files)\n");
+    printf("5. Corpus Scan from a Saved Index\n");
+    printf("6. Corpus Session (add / remove / query over a live corpus)\n");
+    printf("7. All-Pairs Cohort Scan (.txt Files)\n");
+    printf("8. Near-Duplicate Triage (MinHash + LSH, .txt Files)\n");
+    printf("9. SimHash Pre-Filter + Scan (many references, .txt Files)\n");
     printf("Choice: ");
     scanf("%d", &choice);
     getchar(); // clear newline
 
+    if (choice == 9) {
+        char filename[256];
+        char **names = malloc(sizeof(char *) * MAX_CORPUS_DOCS);
+        int numRefs = 0, n = 3, w = 3, radius = SIMHASH_MAX_DISTANCE;
+        printf("\nEnter reference filenames, ending with . (e.g., doc1.txt doc2.txt .): ");
+        while (numRefs < MAX_CORPUS_DOCS && scanf("%255s", filename) == 1 && strcmp(filename, ".") != 0) {
+            names[numRefs++] = strdup(filename);
+        }
+        printf("Enter filename for Suspect (e.g., doc2.txt): ");
+        if (scanf("%255s", filename) != 1 || !(docB = read_file(filename))) {
+            printf("Error: Could not read the suspect file.\n");
+            for (int d = 0; d < numRefs; d++) free(names[d]);
+            free(names);
+            return 1;
+        }
+        printf("Enter n-gram size and window size (e.g., 3 3): ");
+        if (scanf("%d %d", &n, &w) != 2 || n < 1 || w < 1) { n = 3; w = 3; }
+        printf("Enter Hamming radius (0-%d) (e.g., %d): ", SIMHASH_MAX_TABLES - 1, SIMHASH_MAX_DISTANCE);
+        if (scanf("%d", &radius) != 1 || radius < 0) radius = SIMHASH_MAX_DISTANCE;
+
+        // First pass: one SimHash per reference and per paragraph. Entry ids
+        // map back to their document.
+        Arena *arena = create_arena(0);
+        Lexicon *lex = create_lexicon();
+        SimHashIndex *sh = create_simhash_index(radius);
+        size_t entryCap = 1024, numEntries = 0;
+        int *entryDoc = malloc(sizeof(int) * entryCap);
+        for (int d = 0; d < numRefs; d++) {
+            char *doc = read_file(names[d]);
+            if (!doc) {
+                printf("Warning: skipping unreadable reference %s\n", names[d]);
+                continue;
+            }
+            int maxParas = 2;
+            for (const char *c = doc; *c; c++) maxParas += *c == '\n';
+            uint64_t *hashes = arena_alloc(arena, sizeof(uint64_t) * maxParas, 16);
+            TokenList tl;
+            int wc = tokenize(arena, preprocess(arena, doc), lex, &tl);
+            Fingerprint *shingles = arena_alloc(arena, sizeof(Fingerprint) * (wc + 1), 16);
+            hashes[0] = simhash(shingles, rolling_hashes(&tl, n, shingles));
+            int count = 1 + simhash_paragraphs(arena, doc, lex, n, hashes + 1, maxParas - 1);
+            for (int i = 0; i < count; i++) {
+                if (numEntries == entryCap) entryDoc = realloc(entryDoc, sizeof(int) * (entryCap *= 2));
+                entryDoc[numEntries] = d;
+                simhash_index_add(sh, hashes[i], (uint32_t)numEntries++);
+            }
+            arena_reset(arena);
+            free(doc);
+        }
+        simhash_index_build(sh);
+
+        int maxParas = 2;
+        for (const char *c = docB; *c; c++) maxParas += *c == '\n';
+        uint64_t *queries = malloc(sizeof(uint64_t) * maxParas);
+        TokenList tokB;
+        int wcB = tokenize(arena, preprocess(arena, docB), lex, &tokB);
+        Fingerprint *hashesB = malloc(sizeof(Fingerprint) * (wcB + 1));
+        int numHashesB = rolling_hashes(&tokB, n, hashesB);
+        queries[0] = simhash(hashesB, numHashesB);
+        int numQueries = 1 + simhash_paragraphs(arena, docB, lex, n, queries + 1, maxParas - 1);
+
+        int *best = malloc(sizeof(int) * (numRefs + 1));
+        for (int d = 0; d < numRefs; d++) best[d] = -1;
+        SimHashMatch *found = malloc(sizeof(SimHashMatch) * (numEntries + 1));
+        double t0 = (double)clock() / CLOCKS_PER_SEC;
+        for (int q = 0; q < numQueries; q++) {
+            int numFound = simhash_index_query(sh, queries[q], found, (int)numEntries + 1);
+            for (int i = 0; i < numFound; i++) {
+                int d = entryDoc[found[i].id];
+                if (best[d] < 0 || found[i].distance < best[d]) best[d] = found[i].distance;
+            }
+        }
+        double t1 = (double)clock() / CLOCKS_PER_SEC;
+        int candidates = 0;
+        for (int d = 0; d < numRefs; d++) candidates += best[d] >= 0;
+        printf("\n--- SimHash Pre-Filter (radius %d, %d tables) ---\n", sh->maxDistance, sh->numTables);
+        printf("Hash family: %s\n", HASH_FAMILY_NAME);
+        printf("%zu document/paragraph hashes, %d suspect lookups (%.3f ms CPU), %d of %d references pass\n",
+               numEntries, numQueries, (t1 - t0) * 1e3, candidates, numRefs);
+
+        // Second pass: the full set_contains comparison, candidates only.
+        for (int d = 0; d < numRefs; d++) {
+            if (best[d] < 0) continue;
+            char *doc = read_file(names[d]);
+            if (!doc) continue;
+            arena_reset(arena);
+            TokenList tl;
+            int wc = tokenize(arena, preprocess(arena, doc), lex, &tl);
+            WinnowedFingerprint *win = arena_alloc(arena, sizeof(WinnowedFingerprint) * (wc + 1), 16);
+            int numWin;
+            fingerprint_tokens(&tl, n, w, NULL, win, &numWin);
+            FingerprintSet *fps = create_set(arena);
+            for (int i = 0; i < numWin; i++) set_insert(fps, win[i].fp);
+            int matches = 0;
+            for (int i = 0; i < numHashesB; i++) matches += set_contains(fps, hashesB[i]);
+            printf("%s | Hamming: %d | Verbatim Score: %.1f%%\n", names[d], best[d],
+                   fps->size ? (double)matches / fps->size * 100.0 : 0.0);
+            free(doc);
+        }
+
+        free(found); free(best); free(queries); free(hashesB); free(entryDoc);
+        free_simhash_index(sh); free_lexicon(lex); free_arena(arena);
+        for (int d = 0; d < numRefs; d++) free(names[d]);
+        free(names); free(docB);
+        return 0;
+    }
+
+    if (choice == 8) {
+        char filename[256];
+        char **names = malloc(sizeof(char *) * MAX_CORPUS_DOCS);
+        int numDocs = 0, n = 3, w = 3;
+        double threshold = 0.5;
+        printf("\nEnter cohort filenames, ending with . (e.g., s1.txt s2.txt s3.txt .): ");
+        while (numDocs < MAX_CORPUS_DOCS && scanf("%255s", filename) == 1 && strcmp(filename, ".") != 0) {
+            names[numDocs++] = strdup(filename);
+        }
+        printf("Enter n-gram size and window size (e.g., 3 3): ");
+        if (scanf("%d %d", &n, &w) != 2 || n < 1 || w < 1) { n = 3; w = 3; }
+        printf("Enter Jaccard threshold (e.g., 0.5): ");
+        if (scanf("%lf", &threshold) != 1 || threshold <= 0.0 || threshold >= 1.0) threshold = 0.5;
+
+        // One pass per submission: a MinHash signature over every shingle, and
+        // the sorted winnowed keys kept for exact scoring of candidates.
+        Arena *arena = create_arena(0);
+        Lexicon *lex = create_lexicon();
+        MinHasher *mh = create_minhasher(MINHASH_SIZE, 1, true);
+        uint64_t *sigs = malloc(sizeof(uint64_t) * MINHASH_SIZE * (numDocs + 1));
+        uint64_t **keys = malloc(sizeof(uint64_t *) * (numDocs + 1));
+        int *numKeys = malloc(sizeof(int) * (numDocs + 1));
+        char **docNames = malloc(sizeof(char *) * (numDocs + 1));
+        int numRead = 0;
+        for (int d = 0; d < numDocs; d++) {
+            char *doc = read_file(names[d]);
+            if (!doc) {
+                printf("Warning: skipping unreadable submission %s\n", names[d]);
+                continue;
+            }
+            TokenList tl;
+            int wc = tokenize(arena, preprocess(arena, doc), lex, &tl);
+            Fingerprint *hashes = arena_alloc(arena, sizeof(Fingerprint) * (wc + 1), 16);
+            minhash_signature(mh, hashes, rolling_hashes(&tl, n, hashes), sigs + (size_t)numRead * MINHASH_SIZE);
+            WinnowedFingerprint *win = arena_alloc(arena, sizeof(WinnowedFingerprint) * (wc + 1), 16);
+            int numWin;
+            fingerprint_tokens(&tl, n, w, NULL, win, &numWin);
+            keys[numRead] = malloc(sizeof(uint64_t) * (numWin + 1));
+            numKeys[numRead] = sorted_keys(arena, win, numWin, keys[numRead]);
+            docNames[numRead++] = names[d];
+            arena_reset(arena);
+            free(doc);
+        }
+
+        int bands, rows;
+        lsh_choose_bands(MINHASH_SIZE, threshold, &bands, &rows);
+        double t0 = (double)clock() / CLOCKS_PER_SEC;
+        CandidatePair *cand;
+        size_t count = lsh_candidates(sigs, numRead, MINHASH_SIZE, bands, rows, threshold, &cand);
+        PairSimilarity *scored = malloc(sizeof(PairSimilarity) * (count + 1));
+        size_t numScored = 0;
+        for (size_t i = 0; i < count; i++) {
+            uint32_t a = cand[i].a, b = cand[i].b;
+            int *hit = arena_alloc(arena, sizeof(int) * (numKeys[b] + 1), 16);
+            int shared = intersect_sorted(keys[a], numKeys[a], keys[b], numKeys[b], hit);
+            int uni = numKeys[a] + numKeys[b] - shared;
+            float jaccard = uni > 0 ? (float)shared / uni : 0.0f;
+            if (jaccard >= threshold) scored[numScored++] = (PairSimilarity){a, b, (uint32_t)shared, jaccard};
+            arena_reset(arena);
+        }
+        double t1 = (double)clock() / CLOCKS_PER_SEC;
+        printf("\n--- Near-Duplicate Triage (%d bands x %d rows) ---\n", bands, rows);
+        printf("Hash family: %s\n", HASH_FAMILY_NAME);
+        printf("%d documents, %zu LSH candidates of %lld pairs, %zu at Jaccard >= %.2f (%.1f ms CPU)\n",
+               numRead, count, (long long)numRead * (numRead - 1) / 2, numScored, threshold, (t1 - t0) * 1e3);
+        for (size_t i = 0; i < numScored && i < 10; i++) {
+            size_t best = i;
+            for (size_t j = i + 1; j < numScored; j++) if (scored[j].jaccard > scored[best].jaccard) best = j;
+            PairSimilarity t = scored[i]; scored[i] = scored[best]; scored[best] = t;
+            printf("[%zu] %s <-> %s | Shared: %u | Jaccard: %.1f%%\n", i + 1, docNames[scored[i].a],
+                   docNames[scored[i].b], scored[i].shared, scored[i].jaccard * 100.0);
+        }
+
+        free(scored); free(cand);
+        for (int d = 0; d < numRead; d++) free(keys[d]);
+        free(keys); free(numKeys); free(docNames); free(sigs);
+        free_minhasher(mh); free_lexicon(lex); free_arena(arena);
+        for (int d = 0; d < numDocs; d++) free(names[d]);
+        free(names);
+        return 0;
+    }
+
+    if (choice == 7) {
+        char filename[256], csvFile[256] = "-";
+        char **names = malloc(sizeof(char *) * MAX_CORPUS_DOCS);
+        int numDocs = 0, n = 3, w = 3, minShared = 1;
+        printf("\nEnter cohort filenames, ending with . (e.g., s1.txt s2.txt s3.txt .): ");
+        while (numDocs < MAX_CORPUS_DOCS && scanf("%255s", filename) == 1 && strcmp(filename, ".") != 0) {
+            names[numDocs++] = strdup(filename);
+        }
+        printf("Enter n-gram size and window size (e.g., 3 3): ");
+        if (scanf("%d %d", &n, &w) != 2 || n < 1 || w < 1) { n = 3; w = 3; }
+        printf("Enter minimum shared fingerprints and CSV output (- to skip) (e.g., 5 pairs.csv): ");
+        if (scanf("%d %255s", &minShared, csvFile) != 2 || minShared < 1) { minShared = 1; strcpy(csvFile, "-"); }
+
+        // Every submission is read and fingerprinted exactly once.
+        Arena *arena = create_arena(0);
+        Lexicon *lex = create_lexicon();
+        InvertedIndex *idx = create_index();
+        for (int d = 0; d < numDocs; d++) {
+            char *doc = read_file(names[d]);
+            if (!doc) {
+                printf("Warning: skipping unreadable submission %s\n", names[d]);
+                continue;
+            }
+            TokenList tl;
+            int wc = tokenize(arena, preprocess(arena, doc), lex, &tl);
+            WinnowedFingerprint *win = arena_alloc(arena, sizeof(WinnowedFingerprint) * (wc + 1), 16);
+            int numWin;
+            fingerprint_tokens(&tl, n, w, NULL, win, &numWin);
+            index_add_document(idx, arena, names[d], win, numWin);
+            arena_reset(arena);
+            free(doc);
+        }
+
+        int threads = online_cores();
+        double t0 = (double)clock() / CLOCKS_PER_SEC;
+        SimilarityMatrix *m = all_pairs_similarity(idx, minShared, 0, threads);
+        double t1 = (double)clock() / CLOCKS_PER_SEC;
+        long long allPairs = (long long)idx->numDocs * (idx->numDocs - 1) / 2;
+        printf("\n--- All-Pairs Analysis (%d threads) ---\n", threads);
+        printf("Hash family: %s\n", HASH_FAMILY_NAME);
+        printf("%d documents, %zu of %lld pairs share >= %d fingerprints (%.1f ms CPU)\n",
+               idx->numDocs, m->count, allPairs, minShared, (t1 - t0) * 1e3);
+
+        // Most similar pairs first.
+        PairSimilarity *ranked = malloc(sizeof(PairSimilarity) * (m->count + 1));
+        memcpy(ranked, m->pairs, sizeof(PairSimilarity) * m->count);
+        for (size_t i = 0; i < m->count && i < 10; i++) {
+            size_t best = i;
+            for (size_t j = i + 1; j < m->count; j++) if (ranked[j].jaccard > ranked[best].jaccard) best = j;
+            PairSimilarity t = ranked[i]; ranked[i] = ranked[best]; ranked[best] = t;
+            printf("[%zu] %s <-> %s | Shared: %u | Jaccard: %.1f%%\n", i + 1,
+                   index_doc_name(idx, ranked[i].a), index_doc_name(idx, ranked[i].b), ranked[i].shared,
+                   ranked[i].jaccard * 100.0);
+        }
+        free(ranked);
+
+        if (strcmp(csvFile, "-") != 0) {
+            FILE *f = fopen(csvFile, "w");
+            if (!f) {
+                printf("Warning: could not write %s\n", csvFile);
+            } else {
+                fprintf(f, "doc_a,doc_b,shared,jaccard\n");
+                for (size_t i = 0; i < m->count; i++) {
+                    fprintf(f, "%s,%s,%u,%.4f\n", index_doc_name(idx, m->pairs[i].a),
+                            index_doc_name(idx, m->pairs[i].b), m->pairs[i].shared, m->pairs[i].jaccard);
+                }
+                fclose(f);
+                printf("Sparse matrix written to %s\n", csvFile);
+            }
+        }
+
+        free_similarity_matrix(m); free_index(idx); free_lexicon(lex); free_arena(arena);
+        for (int d = 0; d < numDocs; d++) free(names[d]);
+        free(names);
+        return 0;
+    }
+
+    if (choice == 6) {
+        int n = 3, w = 3;
+        printf("Enter n-gram size and window size (e.g., 3 3): ");
+        if (scanf("%d %d", &n, &w) != 2 || n < 1 || w < 1) { n = 3; w = 3; }
+        printf("Commands: add <file> | commit | remove <id> | query <file> <k> | compact | stats | quit\n");
+
+        Arena *arena = create_arena(0);
+        Lexicon *lex = create_lexicon();
+        Corpus *corpus = create_corpus();
+        corpus_start_compactor(corpus);
+        char cmd[16], filename[256];
+        while (printf("> "), fflush(stdout), scanf("%15s", cmd) == 1 && strcmp(cmd, "quit") != 0) {
+            if (strcmp(cmd, "add") == 0 || strcmp(cmd, "query") == 0) {
+                int k = TOP_K;
+                if (scanf("%255s", filename) != 1) break;
+                if (cmd[0] == 'q' && (scanf("%d", &k) != 1 || k < 1)) k = TOP_K;
+                char *doc = read_file(filename);
+                if (!doc) {
+                    printf("Error: Could not read %s\n", filename);
+                    continue;
+                }
+                TokenList tl;
+                int wc = tokenize(arena, preprocess(arena, doc), lex, &tl);
+                free(doc);
+                if (cmd[0] == 'a') {
+                    WinnowedFingerprint *win = arena_alloc(arena, sizeof(WinnowedFingerprint) * (wc + 1), 16);
+                    int numWin;
+                    fingerprint_tokens(&tl, n, w, NULL, win, &numWin);
+                    printf("Staged %s as document %u\n", filename, corpus_add_document(corpus, arena, filename, win, numWin));
+                } else {
+                    Fingerprint *hashes = arena_alloc(arena, sizeof(Fingerprint) * (wc + 1), 16);
+                    int numHashes = rolling_hashes(&tl, n, hashes);
+                    DocHit *hits = arena_alloc(arena, sizeof(DocHit) * k, 16);
+                    CorpusSnapshot *snap = corpus_snapshot(corpus);
+                    int numHits = corpus_query(snap, hashes, numHashes, k, hits);
+                    print_doc_hits(hits, numHits, &tl, n);
+                    corpus_release(corpus, snap);
+                }
+                arena_reset(arena);
+            } else if (strcmp(cmd, "commit") == 0) {
+                printf("Committed %d documents\n", corpus_commit(corpus));
+            } else if (strcmp(cmd, "remove") == 0) {
+                unsigned id;
+                if (scanf("%u", &id) != 1) break;
+                printf(corpus_remove(corpus, id) ? "Removed document %u\n" : "No committed document %u\n", id);
+            } else if (strcmp(cmd, "compact") == 0) {
+                printf(corpus_compact(corpus, true) ? "Compacted\n" : "Nothing to compact\n");
+            } else if (strcmp(cmd, "stats") == 0) {
+                CorpusSnapshot *snap = corpus_snapshot(corpus);
+                int live = 0, removed = 0;
+                for (int i = 0; i < snap->numSegs; i++) {
+                    int dead = snap->dead[i] ? snap->dead[i]->count : 0;
+                    printf("  segment %d: %d documents (%d removed), %zu postings\n",
+                           i, snap->segs[i]->idx->numDocs, dead, snap->segs[i]->idx->numPostings);
+                    live += snap->segs[i]->idx->numDocs - dead;
+                    removed += dead;
+                }
+                printf("%d live documents, %d tombstones, %d segments, %d compactions\n",
+                       live, removed, snap->numSegs, corpus->compactions);
+                corpus_release(corpus, snap);
+            } else {
+                printf("Unknown command %s\n", cmd);
+            }
+        }
+        free_corpus(corpus); free_lexicon(lex); free_arena(arena);
+        return 0;
+    }
+
+    if (choice == 4 || choice == 5) {
+        char filename[256], indexFile[256] = "-";
+        char **names = malloc(sizeof(char *) * MAX_CORPUS_DOCS);
+        int numRefs = 0, n = 3, w = 3, k = TOP_K;
+        if (choice == 4) {
+            printf("\nEnter reference filenames, ending with . (e.g., doc1.txt doc2.txt .): ");
+            while (numRefs < MAX_CORPUS_DOCS && scanf("%255s", filename) == 1 && strcmp(filename, ".") != 0) {
+                names[numRefs++] = strdup(filename);
+            }
+        } else {
+            printf("\nEnter index filename (e.g., corpus.tgi): ");
+            if (scanf("%255s", indexFile) != 1) indexFile[0] = '\0';
+        }
+        printf("Enter filename for Suspect (e.g., doc2.txt): ");
+        if (scanf("%255s", filename) != 1 || !(docB = read_file(filename))) {
+            printf("Error: Could not read the suspect file.\n");
+            for (int d = 0; d < numRefs; d++) free(names[d]);
+            free(names);
+            return 1;
+        }
+        if (choice == 4) {
+            printf("Enter n-gram size and window size (e.g., 3 3): ");
+            if (scanf("%d %d", &n, &w) != 2 || n < 1 || w < 1) { n = 3; w = 3; }
+            printf("Save the index to (- to skip) (e.g., corpus.tgi): ");
+            if (scanf("%255s", indexFile) != 1) strcpy(indexFile, "-");
+        }
+        printf("Enter number of documents to report (e.g., 5): ");
+        if (scanf("%d", &k) != 1 || k < 1) k = TOP_K;
+
+        Arena *arena = create_arena(0);
+        Lexicon *lex = create_lexicon();
+        InvertedIndex *idx = choice == 4 ? create_index() : open_index(indexFile, &n, &w);
+        if (!idx) {
+            printf("Error: Could not open index %s (missing, corrupt, or built with another hash family).\n", indexFile);
+            free_lexicon(lex); free_arena(arena); free(names); free(docB);
+            return 1;
+        }
+        // Each reference is fingerprinted in a scratch arena that is reset
+        // before the next one; only the index outlives it.
+        for (int d = 0; d < numRefs; d++) {
+            char *doc = read_file(names[d]);
+            if (!doc) {
+                printf("Warning: skipping unreadable reference %s\n", names[d]);
+                continue;
+            }
+            TokenList tl;
+            int wc = tokenize(arena, preprocess(arena, doc), lex, &tl);
+            WinnowedFingerprint *win = arena_alloc(arena, sizeof(WinnowedFingerprint) * (wc + 1), 16);
+            int numWin;
+            fingerprint_tokens(&tl, n, w, NULL, win, &numWin);
+            index_add_document(idx, arena, names[d], win, numWin);
+            arena_reset(arena);
+            free(doc);
+        }
+        if (choice == 4) {
+            index_build_filter(idx);
+            if (strcmp(indexFile, "-") != 0 && !index_save(idx, indexFile, n, w)) {
+                printf("Warning: could not write index %s\n", indexFile);
+            }
+        }
+
+        TokenList tokB;
+        int wcB = tokenize(arena, preprocess(arena, docB), lex, &tokB);
+        Fingerprint *hashesB = arena_alloc(arena, sizeof(Fingerprint) * (wcB + 1), 16);
+        int numHashesB = rolling_hashes(&tokB, n, hashesB);
+        DocHit *hits = arena_alloc(arena, sizeof(DocHit) * k, 16);
+        ShardedIndex *si = create_sharded_index(idx, default_shard_count());
+        int numHits = sharded_query(si, hashesB, numHashesB, k, hits);
+
+        printf("\n--- Corpus Analysis ---\n");
+        printf("Hash family: %s\n", HASH_FAMILY_NAME);
+        printf("%s %d documents (%u fingerprints, %zu postings, n = %d, w = %d)\n", idx->map ? "Mapped" : "Indexed",
+               idx->numDocs, idx->numTerms, idx->numPostings, n, w);
+        printf("Query shards: %d\n", si->numShards);
+        print_doc_hits(hits, numHits, &tokB, n);
+
+        free_sharded_index(si); free_index(idx); free_lexicon(lex); free_arena(arena);
+        for (int d = 0; d < numRefs; d++) free(names[d]);
+        free(names); free(docB);
+        return 0;
+    }
+
     if (choice == 1) {
         printf("\nEnter Original Document (A):\n");
         fgets(buffer, MAX_TEXT, stdin);
@@ -240,73 +5140,105 @@ int main() {
         }
     }
 
-    int n = 3, w = 3;
+    if (choice == 3) {
+        int ns[MAX_RESOLUTIONS], numRes = 0, v, w = 3;
+        printf("Enter n-gram sizes, ending with 0 (e.g., 3 5 8 0): ");
+        while (numRes < MAX_RESOLUTIONS && scanf("%d", &v) == 1 && v > 0) ns[numRes++] = v;
+        if (numRes == 0) { ns[0] = 3; ns[1] = 5; ns[2] = 8; numRes = 3; }
+        printf("Enter window size (e.g., 3): ");
+        if (scanf("%d", &w) != 1 || w < 1) w = 3;
+
+        Arena *arena = create_arena(0);
+        char *cleanA = preprocess(arena, docA), *cleanB = preprocess(arena, docB);
+        Lexicon *lex = create_lexicon();
+        TokenList tokA, tokB;
+        tokenize(arena, cleanA, lex, &tokA);
+        tokenize(arena, cleanB, lex, &tokB);
+
+        double scores[MAX_RESOLUTIONS];
+        multi_resolution_scores(arena, &tokA, &tokB, ns, numRes, w, scores);
+        printf("\n--- Multi-Resolution Analysis (w = %d) ---\n", w);
+        printf("Hash family: %s\n", HASH_FAMILY_NAME);
+        for (int r = 0; r < numRes; r++) printf("n = %-2d  Verbatim Score: %.1f%%\n", ns[r], scores[r]);
+
+        free_lexicon(lex); free_arena(arena);
+        free(docA); free(docB);
+        return 0;
+    }
+
+    int n = 3, w = 3, k = TOP_K, tie = TIE_FIRST_POSITION;
+    printf("Enter n-gram size and window size (e.g., 3 3): ");
+    if (scanf("%d %d", &n, &w) != 2 || n < 1 || w < 1) { n = 3; w = 3; }
+    printf("Enter top-K and tie-break (0 = first position, 1 = phrase length) (e.g., 5 0): ");
+    if (scanf("%d %d", &k, &tie) != 2 || k < 0 || tie < 0 || tie > 1) { k = TOP_K; tie = TIE_FIRST_POSITION; }
     printf("\n--- Analysis Start ---\n");
+    printf("Hash family: %s\n", HASH_FAMILY_NAME);
+
+    // Everything below belongs to this one comparison and lives in the arena.
+    Arena *arena = create_arena(0);
 
     // 1. Prepare Doc A
-    char *cleanA = preprocess(docA);
-    char wordsA[MAX_WORDS][MAX_WORD_LEN];
-    int wcA = tokenize(cleanA, wordsA);
-    int numHashesA = wcA - n + 1;
-    Fingerprint *hashesA = malloc(sizeof(Fingerprint) * numHashesA);
-    for (int i = 0; i < numHashesA; i++) hashesA[i] = get_double_hash(wordsA, i, n);
-
-    FingerprintSet *fpsA = create_set();
-    BloomFilter *bf = create_bloom();
-    for (int i = 0; i <= numHashesA - w; i++) {
-        Fingerprint minF = hashesA[i];
-        for (int j = 1; j < w; j++) if (hashesA[i+j].h1 < minF.h1) minF = hashesA[i+j];
-        set_insert(fpsA, minF);
-        bloom_add(bf, minF);
+    char *cleanA = preprocess(arena, docA);
+    Lexicon *lex = create_lexicon();
+    TokenList tokA;
+    int wcA = tokenize(arena, cleanA, lex, &tokA);
+    WinnowedFingerprint *winA = arena_alloc(arena, sizeof(WinnowedFingerprint) * (wcA + 1), 16);
+    int numWinA;
+    fingerprint_tokens(&tokA, n, w, NULL, winA, &numWinA);
+
+#if USE_MERGE_JOIN
+    uint64_t *keysA = arena_alloc(arena, sizeof(uint64_t) * (numWinA + 1), 16);
+    int refSize = sorted_keys(arena, winA, numWinA, keysA);
+    printf("Intersection: sorted merge-join\n");
+#else
+    FingerprintSet *fpsA = create_set(arena);
+#if USE_FUSE_FILTER
+    for (int i = 0; i < numWinA; i++) set_insert(fpsA, winA[i].fp);
+    FuseFilter *ff = fuse_filter_from_set(arena, fpsA);
+    printf("Gatekeeper: binary fuse filter (%.1f bits/key)\n",
+           ff && ff->size ? ff->arrayLength * 8.0 / ff->size : 0.0);
+#else
+    BloomFilter *bf = create_bloom(arena, numWinA, BLOOM_FPR);
+    for (int i = 0; i < numWinA; i++) {
+        set_insert(fpsA, winA[i].fp);
+        bloom_add(bf, winA[i].fp);
     }
+#endif
+    int refSize = (int)fpsA->size;
+#endif
 
     // 2. Scan Doc B and Track Frequencies
-    char *cleanB = preprocess(docB);
-    char wordsB[MAX_WORDS][MAX_WORD_LEN];
-    int wcB = tokenize(cleanB, wordsB);
-    int numHashesB = wcB - n + 1;
-    int total_matches = 0;
-    FrequencyMap *fm = create_freq_map();
-
-    for (int i = 0; i < numHashesB; i++) {
-        Fingerprint f = get_double_hash(wordsB, i, n);
-        if (bloom_check(bf, f) && set_contains(fpsA, f)) {
-            total_matches++;
-            // Reconstruct phrase for the frequency map
-            char phrase[256] = "";
-            for(int k=0; k<n; k++) { strcat(phrase, wordsB[i+k]); if(k<n-1) strcat(phrase, " "); }
-            freq_update(fm, f, phrase);
-        }
-    }
-
-    // 3. Extract Top K using Min-Heap
-    FreqEntry heap[TOP_K];
-    int heapSize = 0;
-    for (int i = 0; i < TABLE_SIZE; i++) {
-        if (fm->table[i].occupied) {
-            if (heapSize < TOP_K) {
-                heap[heapSize] = fm->table[i];
-                heapSize++;
-                if (heapSize == TOP_K) {
-                    for (int j = (TOP_K / 2) - 1; j >= 0; j--) min_heapify(heap, TOP_K, j);
-                }
-            } else if (fm->table[i].frequency > heap[0].frequency) {
-                heap[0] = fm->table[i];
-                min_heapify(heap, TOP_K, 0);
-            }
-        }
-    }
+    char *cleanB = preprocess(arena, docB);
+    TokenList tokB;
+    int wcB = tokenize(arena, cleanB, lex, &tokB);
+    Fingerprint *hashesB = arena_alloc(arena, sizeof(Fingerprint) * (wcB + 1), 16);
+    int numHashesB = rolling_hashes(&tokB, n, hashesB);
+    PhraseTally *tally = tally_create(arena, k, (TieBreak)tie);
+#if USE_MERGE_JOIN
+    int total_matches = merge_scan_suspect(arena, hashesB, numHashesB, &tokB, n, keysA, refSize, tally);
+#elif USE_FUSE_FILTER
+    int total_matches = scan_suspect(hashesB, numHashesB, &tokB, n, ff, fpsA, tally);
+#else
+    int total_matches = scan_suspect(hashesB, numHashesB, &tokB, n, bf, fpsA, tally);
+#endif
+
+    // 3. Read the Top K, ranked incrementally during the scan
+    FreqEntry *top = arena_alloc(arena, sizeof(FreqEntry) * (k + 1), 16);
+    int topSize = tally_top(tally, top);
 
     // 4. Final Display
-    double score = (double)total_matches / (fpsA->size) * 100.0;
+    double score = (double)total_matches / refSize * 100.0;
     printf("\nOverall Verbatim Score: %.1f%%\n", score);
-    printf("\nTOP %d MOST FREQUENT PLAGIARIZED PHRASES:\n", heapSize);
-    printf("--------------------------------------------------\n");
-    for (int i = heapSize - 1; i >= 0; i--) {
-        printf("[%d] Freq: %d | Phrase: \"%s\"\n", heapSize - i, heap[i].frequency, heap[i].phrase);
-    }
+    print_top_phrases(top, topSize, &tokB, n);
+#if USE_SPACE_SAVING
+    printf("(Space-Saving, %d counters: each Freq overestimates by at most %lld)\n",
+           tally->m, ss_error_bound(tally));
+#endif
 
-    // Cleanup
-    free(docA); free(docB); free(cleanA); free(cleanB); free(hashesA);
+    // Cleanup: one call releases the whole comparison (arena_reset would keep
+    // the pages for the next one).
+    free_arena(arena);
+    free(docA); free(docB);
+    free_lexicon(lex);
     return 0;
 }
\ No newline at end of file